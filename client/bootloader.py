@@ -2,8 +2,13 @@
 
 import itertools
 from msg import *
+from imagefile import read_image, data_runs
+import hashlib
 import math
+import struct
+import sys
 import time
+import zlib
 
 # Wrapper for a board type
 class Board:
@@ -31,11 +36,33 @@ class Board:
         resp = self._conn.query(CmdType.GET_MODE)
         return Mode(resp['value'])
 
+    # Switches the board's uart (the one the port is on) and the port to
+    # baud. False, and still at the old rate, if the board can't do that
+    # or nothing gets through at the new one
+    def set_baud(self, baud):
+        port = self._conn.port
+        old = port.baud
+        switched = False
+
+        # Before anything else goes out at the old rate
+        def switch(msg):
+            nonlocal switched
+            if msg['cmd'] != CmdType.OKAY:
+                return
+            port.set_baud(baud)
+            switched = self._conn.try_status() is not None
+            if not switched:
+                port.set_baud(old)
+                time.sleep(BAUD_FALLBACK)
+
+        self._conn.query(CmdType.SET_BAUD, value=baud, after=switch)
+        return switched
+
     def unlock_flash(self):
         self._conn.query(CmdType.UNLOCK_FLASH)
 
     def lock_flash(self):
-        self._conn.query(CmdType.UNLOCK_FLASH)
+        self._conn.query(CmdType.LOCK_FLASH)
 
     def move(self, pos):
         self._conn.query(CmdType.MOVE, value=pos)
@@ -56,6 +83,16 @@ class Board:
             data = data + msg['payload']
         return data
 
+    # Streams length bytes from the current position,
+    # picking up where it left off after a bad frame
+    def read_stream(self, length):
+        start = self.position()
+        data = bytes()
+        while len(data) < length:
+            self.move(start + len(data))
+            data = data + self._conn.read_stream(length - len(data))
+        return data
+
     def write(self, data):
         if len(data) > 4:
             data = data[:4]
@@ -66,12 +103,45 @@ class Board:
     def erase(self, length):
         self._conn.query(CmdType.ERASE, value=length, timeout=20);
 
-    # Does the whole flashing rigmarole
-    def load(self, data, write_callback = lambda i,b: None):
-        self.unlock_flash()
-        # Move to the start of the flash block
-        start_pos = self.move_start()
-        blocks = int((len(data) + 3)/4)
+    # Runs ops (a list of (cmd, payload, value)) in one go,
+    # returns the reply of the last one
+    def batch(self, ops, timeout=1):
+        msg = self._conn.batch(ops, timeout)
+        if msg is None or msg['cmd'] == CmdType.ERROR:
+            raise IOError('Batch failed at op {}'.format(msg['payload'][0] if msg else '?'))
+        return msg
+
+    # Checks the sectors covering length bytes from the slot start, returns
+    # a mask of the blank ones (bit 0 being the first) and their number
+    def blank_sectors(self, length):
+        msg = self._conn.query(CmdType.BLANK_CHECK, value=length)
+        if msg is None or msg['cmd'] != CmdType.OKAY:
+            raise IOError('Could not blank check {} bytes'.format(length))
+        return msg['value'] & 0xFFFFFF, msg['payload'][3]
+
+    # Selects the slot that erase/load/image_info work on,
+    # returns the start of the slot
+    def set_slot(self, slot):
+        msg = self._conn.query(CmdType.SET_SLOT, payload=[slot.value, 0, 0, 0])
+        if msg is None or msg['cmd'] != CmdType.OKAY:
+            raise IOError('Could not select slot {}'.format(slot))
+        return msg['value']
+
+    # Returns a field of the board's (valid) app image header, None if there is no valid image
+    def image_info(self, field):
+        msg = self._conn.query(CmdType.IMAGE_INFO, payload=[field.value, 0, 0, 0])
+        if msg is None or msg['cmd'] != CmdType.OKAY:
+            return None
+        return msg['value']
+
+    # Whether the board already has this exact image in the given slot
+    def has_image(self, version, build_hash, slot=Slot.APP):
+        self.set_slot(slot)
+        return self.image_info(ImageField.VERSION) == version and \
+               self.image_info(ImageField.BUILD_HASH) == build_hash
+
+    # The slow path of load(), a write() per word
+    def _load_words(self, data, start_pos, write_callback):
         repeated = [iter(data)] * 4
         packets = map(lambda x: bytes(x), itertools.zip_longest(*repeated, fillvalue=0))
         for i, packet in enumerate(packets):
@@ -86,9 +156,133 @@ class Board:
 
             if DEBUG: print('writing 0x{:08x}: {}'.format(position, packet.hex()))
             self.write(packet)
-            write_callback(i + 1, blocks)
-                
-        self.lock_flash()
+            write_callback(i + 1)
+
+    # Does the whole flashing rigmarole, fast streams the image (see
+    # Conn.write_stream) instead of going through write() word by word.
+    # Runs of at least min_gap 0xFF bytes are skipped (0 to write them
+    # too), the slot has to be erased for that. fec is passed on to
+    # write_stream
+    def load(self, data, version=0, build_hash=None, write_callback = lambda i,b: None,
+             fast=True, min_gap=64, fec=0):
+        if build_hash is None:
+            build_hash = default_build_hash(data)
+        # Move to the start of the flash block,
+        # the image goes after the header
+        header_pos = self.batch([(CmdType.UNLOCK_FLASH, None, None),
+                                 (CmdType.MOVE_START, None, None)])['value']
+        start_pos = header_pos + IMAGE_HEADER_SIZE
+        blocks = int((len(data) + 3)/4)
+        runs = data_runs(data, min_gap) if min_gap > 0 else [(0, data)]
+        for offset, run in runs:
+            self.move(start_pos + offset)
+            progress = lambda i, *_: write_callback(offset // 4 + i, blocks)
+            if fast and not DEBUG:
+                self._conn.write_stream(CmdType.WRITE, run, callback=progress, fec=fec)
+            else:
+                self._load_words(run, start_pos + offset, progress)
+
+        self.finish_load(header_pos, data, version, build_hash)
+
+    # The header goes last so that
+    # a partial load never looks valid
+    def finish_load(self, header_pos, data, version, build_hash):
+        header = struct.pack('<LLLLL', IMAGE_MAGIC, len(data), zlib.crc32(data),
+                             version, build_hash)
+        # (the verified flag in between stays erased)
+        digest = hashlib.sha256(data).digest()
+        self.batch([(CmdType.MOVE, None, header_pos)] +
+                   [(CmdType.WRITE, header[i:i+4], None) for i in range(0, len(header), 4)] +
+                   [(CmdType.MOVE, None, header_pos + IMAGE_DIGEST_OFFSET)] +
+                   [(CmdType.WRITE, digest[i:i+4], None) for i in range(0, len(digest), 4)] +
+                   [(CmdType.LOCK_FLASH, None, None)])
+
+    # Joins group (0 leaves, else at least MIN_GROUP_ID) for blocks
+    # blocks from the position, returns the position
+    def group_join(self, group, blocks):
+        if group and not MIN_GROUP_ID <= group <= 0xFF:
+            raise ValueError('Group ids go from {:#x} to 0xff'.format(MIN_GROUP_ID))
+        msg = self._conn.query(CmdType.GROUP_JOIN, payload=[group, blocks & 0xFF, blocks >> 8, 0])
+        if msg is None or msg['cmd'] != CmdType.OKAY:
+            raise IOError('Board {} could not join group {}'.format(self._id, group))
+        return msg['value']
+
+    # The blocks of the group write the board is missing
+    def group_missing(self, blocks, tries=5):
+        length = (blocks + 7) // 8
+        bitmap = bytes()
+
+        def collect(msg):
+            nonlocal bitmap
+            bitmap = bytes()
+            if msg['cmd'] != CmdType.OKAY:
+                return
+            while len(bitmap) < length:
+                chunk = self._conn.port.read_bulk()
+                if chunk is None:
+                    self._conn.port.drain()
+                    break
+                bitmap = bitmap + chunk
+
+        for _ in range(tries):
+            msg = self._conn.query(CmdType.GROUP_MISSING, after=collect)
+            if msg is not None and msg['cmd'] == CmdType.ERROR:
+                raise IOError('Board {} could not program its blocks'.format(self._id))
+            if len(bitmap) >= length:
+                return {i for i in range(blocks) if bitmap[i // 8] & (1 << (i % 8))}
+        raise IOError('Could not get the missing blocks of board {}'.format(self._id))
+
+# Loads the same image into all the boards at once: the blocks go out once
+# to the group (which every board joins), then the ones any board missed
+# go out again until none are missing. Erased (all 0xFF) blocks are left
+# out. Every window blocks the pacer (by default the first board, i.e.
+# the gateway onto the bus) gets a status request, so nothing piles up
+# on the way. progress gets the round, the blocks sent and still missing
+def load_group(boards, group, data, version=0, build_hash=None, pacer=None,
+               window=4, rounds=20, progress=lambda r, s, m: None):
+    if build_hash is None:
+        build_hash = default_build_hash(data)
+    blocks = (len(data) + GROUP_BLOCK_SIZE - 1) // GROUP_BLOCK_SIZE
+    if blocks > MAX_GROUP_BLOCKS:
+        raise ValueError('Images take up to {} blocks'.format(MAX_GROUP_BLOCKS))
+    padded = data + bytes([0xFF]) * (blocks * GROUP_BLOCK_SIZE - len(data))
+    block = lambda i: padded[i * GROUP_BLOCK_SIZE:(i + 1) * GROUP_BLOCK_SIZE]
+    erased = bytes([0xFF]) * GROUP_BLOCK_SIZE
+    blank = {i for i in range(blocks) if block(i) == erased}
+
+    header_pos = []
+    for board in boards:
+        header_pos.append(board.batch([(CmdType.UNLOCK_FLASH, None, None),
+                                       (CmdType.MOVE_START, None, None)])['value'])
+        board.move(header_pos[-1] + IMAGE_HEADER_SIZE)
+        board.group_join(group, blocks)
+
+    conn = (pacer or boards[0]).conn
+    todo = [i for i in range(blocks) if i not in blank]
+    for r in range(rounds):
+        for k, i in enumerate(todo):
+            start = pack_msg({'board_id': group, 'cmd': CmdType.GROUP_BLOCK, 'value': i})
+            conn.port.write_frames(start + encode_frames(group, CmdType.GROUP_WRITE, 0,
+                                                         block(i), length=i & 0xFF))
+            if (k + 1) % window == 0:
+                conn.status()
+        sent = len(todo)
+        missing = set()
+        for board in boards:
+            missing |= board.group_missing(blocks)
+        todo = sorted(missing - blank)
+        progress(r, sent, len(todo))
+        if not todo:
+            break
+    else:
+        raise IOError('Still missing {} blocks after {} rounds'.format(len(todo), rounds))
+
+    for board, pos in zip(boards, header_pos):
+        board.group_join(0, 0)
+        board.finish_load(pos, data, version, build_hash)
+
+def default_build_hash(data):
+    return struct.unpack('<L', hashlib.sha1(data).digest()[:4])[0]
 
 if __name__=='__main__':
     # Run the application!
@@ -97,6 +291,9 @@ if __name__=='__main__':
     parser = argparse.ArgumentParser()
     parser.add_argument("--dev", help="The USB device to connect to", default="/dev/ttyACM0")
     parser.add_argument("--baud", type=int, help="The baud rate", default=921600)
+    parser.add_argument("--fast_baud", type=int, help="Switch to this baud rate once connected", default=0)
+    parser.add_argument("--udp", type=str, help="Connect over udp to host[:port] instead", default="")
+    parser.add_argument("--tcp", type=str, help="Run the uart framing over tcp to host:port instead", default="")
     parser.add_argument("--print_stream", help="Just read out the incoming stream", action="store_true")
 
     parser.add_argument("--id", type=int, help="The ID of the target board", default=1)
@@ -116,23 +313,81 @@ if __name__=='__main__':
     parser.add_argument("--erase", type=int, help="Wipes the app flash memory", nargs='?', const=0, default=-1)
     parser.add_argument("--dump", type=int, help="Dumps a certain number of bytes from the start \
                                                   to a file", nargs='?', const=4, default=-1)
-    parser.add_argument("--load", type=str, help="Writes a file into the app flash memory", default="")
+    parser.add_argument("--load", type=str, help="Writes a file (raw binary, ELF or Intel HEX) into the app flash memory", default="")
+    parser.add_argument("--min_gap", type=int, help="Skip runs of at least this many 0xFF bytes when loading (0 to write them)", default=64)
+    parser.add_argument("--version", type=int, help="Version to record in the image header", default=0)
+    parser.add_argument("--build_hash", type=lambda x: int(x, 16),
+                        help="Build hash (hex) to record in the image header, defaults to one of the image")
+    parser.add_argument("--group_ids", type=str, help="Load into these boards (comma separated) at once with a group write", default="")
+    parser.add_argument("--group", type=int, help="Group id for --group_ids", default=0x80)
+    parser.add_argument("--slow_load", help="Load a msg at a time instead of streaming", action="store_true")
+    parser.add_argument("--fec", type=int, help="Send a PARITY after every this many streamed writes (0 for none)", default=0)
+    parser.add_argument("--force", help="Load even if the board already has the same image", action="store_true")
+    parser.add_argument("--app_start", type=lambda x: int(x, 16), default=APP_START,
+                        help="Start (hex) of the board's app slot, ELF/HEX images have to be linked to run right after its header")
+    parser.add_argument("--slot", choices=["app", "staging"], default="staging",
+                        help="Slot to erase/load, staged images are installed on the next boot into the app")
     args = parser.parse_args()
 
     load_data = None
     if len(args.load) > 0:
-        with open(args.load, 'rb') as fh:
-            load_data = fh.read()
-
-    device = Port(args.dev, args.baud)
+        load_base, load_data = read_image(args.load)
+        if load_base is not None:
+            print('Image at 0x{:08x}, {} bytes'.format(load_base, len(load_data)))
+            # It gets written after the slot header whatever its addresses say
+            if load_base != args.app_start + IMAGE_HEADER_SIZE:
+                parser.error('{} is linked for 0x{:08x}, the app runs from 0x{:08x}'.format(
+                    args.load, load_base, args.app_start + IMAGE_HEADER_SIZE))
+        if args.min_gap > 0:
+            written = sum(len(run) for _, run in data_runs(load_data, args.min_gap))
+            print('Skipping {} of {} bytes (erased)'.format(len(load_data) - written, len(load_data)))
+
+    if args.udp:
+        host, _, udp_port = args.udp.partition(':')
+        device = UdpPort(host, int(udp_port) if udp_port else UDP_DEFAULT_PORT)
+    elif args.tcp:
+        host, _, tcp_port = args.tcp.rpartition(':')
+        device = Port(None, 0, dev=SocketDev(host or 'localhost', int(tcp_port)))
+    else:
+        device = Port(args.dev, args.baud)
 
     if args.print_stream:
         while True:
             print(read(device))
 
 
+    if args.group_ids and load_data is not None:
+        boards = [Board(device, int(i)) for i in args.group_ids.split(',')]
+        for b in boards:
+            b.set_slot(Slot.APP if args.slot == "app" else Slot.STAGING)
+            if args.erase >= 0:
+                b.erase(IMAGE_HEADER_SIZE + len(load_data))
+        start = time.time()
+        load_group(boards, args.group, load_data, args.version, args.build_hash,
+                   progress=lambda r, s, m: print('Round {}: sent {} blocks, {} missing'.format(r + 1, s, m)))
+        print('Flashed {} boards at {} bps'.format(len(boards), len(load_data) / (time.time() - start)))
+        sys.exit(0)
+
     board = Board(device, args.id)
 
+    if args.fast_baud and not args.udp and not args.tcp:
+        if board.set_baud(args.fast_baud):
+            print('Switched to {} baud'.format(args.fast_baud))
+        else:
+            print('Could not switch to {} baud, staying at {}'.format(args.fast_baud, args.baud))
+
+    build_hash = args.build_hash
+    if load_data is not None:
+        if build_hash is None:
+            build_hash = default_build_hash(load_data)
+        if not args.force and board.has_image(args.version, build_hash):
+            print('Board already has version {} ({:08x}), skipping load'.format(args.version, build_hash))
+            load_data = None
+
+    slot = Slot.APP if args.slot == "app" else Slot.STAGING
+    if load_data is not None or args.erase >= 0 or args.dump > 0 or args.move_start:
+        board.set_slot(slot)
+
     # Mode related things
     if args.set_mode_app:
         board.set_mode(Mode.APP)
@@ -151,15 +406,19 @@ if __name__=='__main__':
 
     if args.dump > 0:
         board.move_start()
-        print(board.read(args.dump)[:args.dump].hex())
+        print(board.read_stream(args.dump).hex())
 
     if args.erase >= 0:
         num_bytes = args.erase
         if num_bytes == 0 and load_data is not None:
-            num_bytes = len(load_data)
-        print('Erasing...')
+            num_bytes = IMAGE_HEADER_SIZE + len(load_data)
         if num_bytes > 0:
-            board.erase(num_bytes)
+            mask, count = board.blank_sectors(num_bytes)
+            blank = bin(mask).count('1')
+            # The board skips the blank ones itself
+            if blank < count:
+                print('Erasing {} of {} sectors...'.format(count - blank, count))
+                board.erase(num_bytes)
         print('Erased')
     
     if len(args.write) > 0:
@@ -170,13 +429,14 @@ if __name__=='__main__':
     if load_data is not None:
         start = time.time()
         if DEBUG:
-            board.load(load_data)
+            board.load(load_data, args.version, build_hash, min_gap=args.min_gap)
         else:
-            board.load(load_data, lambda i, b: \
+            board.load(load_data, args.version, build_hash, lambda i, b: \
                     print('Wrote block {}/{} (tr: {:5.0f} mps, ti: {:5.8f}s, bt: {:3d})' \
                             .format(i, b, board.conn.transmission_rate, \
                                     board.conn.transmission_interval,
-                                    board.conn.bad_transmits), end='\r'))
+                                    board.conn.bad_transmits), end='\r'),
+                    fast=not args.slow_load, min_gap=args.min_gap, fec=args.fec)
         print()
         elapsed = time.time() - start
         print('Flashed at {} bps'.format(len(load_data) / elapsed))
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+
+# Loads the same image into a number of native bootloaders on a simulated
+# bus (see linksim.BusSim), once with a group write and once board by
+# board, and reports how long each took and how much went onto the bus:
+#
+#   groupbench.py ../build-native/native-bootloader --boards 8 --profile frames
+
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+from bootloader import *
+from linksim import BusSim, PROFILES
+
+STAGING_OFFSET = 0x140000
+GROUP_ID = 0x80
+
+def run(bootloader, count, link, data, port, seed, group):
+    flashes = [tempfile.NamedTemporaryFile() for _ in range(count)]
+    procs = [subprocess.Popen([bootloader, 'tcp:{}'.format(port + i), f.name, str(i + 1)],
+                              stdout=subprocess.DEVNULL) for i, f in enumerate(flashes)]
+    try:
+        time.sleep(0.2)
+        bus = BusSim(0, [('localhost', port + i) for i in range(count)], link, seed=seed).start()
+        device = Port(None, 0, dev=SocketDev('localhost', bus.port))
+        boards = [Board(device, i + 1) for i in range(count)]
+        for board in boards:
+            board.set_slot(Slot.STAGING)
+
+        rounds = 0
+        def progress(r, sent, missing):
+            nonlocal rounds
+            rounds = r + 1
+
+        start = time.time()
+        if group:
+            load_group(boards, GROUP_ID, data, progress=progress)
+        else:
+            for board in boards:
+                board.load(data)
+        elapsed = time.time() - start
+
+        good = True
+        for f in flashes:
+            with open(f.name, 'rb') as fh:
+                fh.seek(STAGING_OFFSET + IMAGE_HEADER_SIZE)
+                good = good and fh.read(len(data)) == data
+        return elapsed, bus.stats[0]['bytes'], rounds, good
+    finally:
+        for proc in procs:
+            proc.kill()
+            proc.wait()
+
+if __name__=='__main__':
+    import argparse
+    parser = argparse.ArgumentParser()
+    parser.add_argument("bootloader", type=str, help="The native-bootloader binary")
+    parser.add_argument("--boards", type=int, action="append", help="Numbers of boards to try")
+    parser.add_argument("--profile", choices=PROFILES.keys(), default="clean")
+    parser.add_argument("--size", type=int, help="Bytes to load", default=16384)
+    parser.add_argument("--port", type=int, help="First port for the native bootloaders", default=7400)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    data = random.Random(args.seed).randbytes(args.size)
+
+    print('{:>6s} {:>6s} {:>8s} {:>10s} {:>6s}  {}'.format(
+        'boards', 'mode', 'time', 'bus bytes', 'rounds', 'images'))
+    failed = False
+    for count in args.boards or [1, 4, 8]:
+        for group in (False, True):
+            elapsed, sent, rounds, good = run(args.bootloader, count, PROFILES[args.profile],
+                                              data, args.port, args.seed, group)
+            print('{:6d} {:>6s} {:7.2f}s {:10d} {:>6s}  {}'.format(
+                count, 'group' if group else 'each', elapsed, sent,
+                str(rounds) if group else '-', 'ok' if good else 'BAD'))
+            failed = failed or not good
+            args.port += count
+    sys.exit(1 if failed else 0)
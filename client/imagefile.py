@@ -0,0 +1,122 @@
+import re
+import struct
+
+# Reads the image to --load from an ELF, an Intel HEX or a raw binary file.
+# The segments of ELF/HEX files are put at their (load) addresses relative to
+# the lowest one, with the gaps left erased (0xFF), so the result is what
+# the slot should hold after the header. Returns the lowest address (None
+# for a raw binary) and the data
+
+ERASED = 0xFF
+# Anything spanning more than the flash has to be a mistake
+# (i.e. a segment meant for ram)
+MAX_SPAN = 2 * 1024 * 1024
+
+PT_LOAD = 1
+SHT_NULL = 0
+SHT_NOBITS = 8
+SHF_ALLOC = 2
+
+# Like objcopy -O binary: the allocated sections with contents (so not the
+# bss, nor the elf headers a load segment might cover), each at its load
+# address, i.e. where the segment holding it gets loaded from
+def read_elf(blob):
+    if blob[4] not in (1, 2) or blob[5] != 1:
+        raise ValueError('Only little-endian ELF files are supported')
+    wide = blob[4] == 2
+    if wide:
+        phoff, shoff = struct.unpack_from('<QQ', blob, 0x20)
+        phentsize, phnum, shentsize, shnum = struct.unpack_from('<HHHH', blob, 0x36)
+    else:
+        phoff, shoff = struct.unpack_from('<LL', blob, 0x1C)
+        phentsize, phnum, shentsize, shnum = struct.unpack_from('<HHHH', blob, 0x2A)
+
+    loads = []
+    for i in range(phnum):
+        off = phoff + i * phentsize
+        if wide:
+            p_type, _, p_offset, _, p_paddr, p_filesz = struct.unpack_from('<LLQQQQ', blob, off)
+        else:
+            p_type, p_offset, _, p_paddr, p_filesz = struct.unpack_from('<LLLLL', blob, off)
+        if p_type == PT_LOAD:
+            loads.append((p_offset, p_paddr, p_filesz))
+
+    segments = []
+    for i in range(shnum):
+        off = shoff + i * shentsize
+        if wide:
+            _, sh_type, sh_flags, _, sh_offset, sh_size = struct.unpack_from('<LLQQQQ', blob, off)
+        else:
+            _, sh_type, sh_flags, _, sh_offset, sh_size = struct.unpack_from('<LLLLLL', blob, off)
+        if sh_type in (SHT_NULL, SHT_NOBITS) or not sh_flags & SHF_ALLOC or sh_size == 0:
+            continue
+        for p_offset, p_paddr, p_filesz in loads:
+            if p_offset <= sh_offset < p_offset + p_filesz:
+                segments.append((p_paddr + sh_offset - p_offset,
+                                 blob[sh_offset:sh_offset + sh_size]))
+                break
+    return segments
+
+def read_hex(text):
+    segments = []
+    base = 0
+    for n, line in enumerate(text.splitlines()):
+        line = line.strip()
+        if not line:
+            continue
+        if not line.startswith(':'):
+            raise ValueError('Line {} is not a HEX record'.format(n + 1))
+        record = bytes.fromhex(line[1:])
+        length, addr, kind = struct.unpack_from('>BHB', record)
+        data = record[4:4 + length]
+        if len(data) != length or sum(record) & 0xFF:
+            raise ValueError('Bad HEX record on line {}'.format(n + 1))
+        if kind == 0x00:
+            segments.append((base + addr, data))
+        elif kind == 0x01:
+            break
+        elif kind == 0x02:
+            base = struct.unpack('>H', data)[0] << 4
+        elif kind == 0x04:
+            base = struct.unpack('>H', data)[0] << 16
+        # 0x03/0x05 are start addresses, the vector table has that
+    return segments
+
+def flatten(segments):
+    if not segments:
+        raise ValueError('No data to load')
+    start = min(addr for addr, _ in segments)
+    end = max(addr + len(data) for addr, data in segments)
+    if end - start > MAX_SPAN:
+        raise ValueError('Segments span 0x{:08x} to 0x{:08x}'.format(start, end))
+    image = bytearray([ERASED]) * (end - start)
+    for addr, data in segments:
+        image[addr - start:addr - start + len(data)] = data
+    return start, bytes(image)
+
+def read_image(path):
+    with open(path, 'rb') as fh:
+        blob = fh.read()
+    if blob[:4] == b'\x7fELF':
+        return flatten(read_elf(blob))
+    if blob[:1] == b':' or path.lower().endswith(('.hex', '.ihex')):
+        return flatten(read_hex(blob.decode('ascii')))
+    return None, blob
+
+# Splits data into the (offset, data) runs worth writing, leaving out word
+# aligned runs of at least min_gap erased bytes (erased flash already
+# holds those, skipping them costs a MOVE instead)
+def data_runs(data, min_gap=64):
+    runs = []
+    pos = 0
+    for m in re.finditer(b'\xff{%d,}' % min_gap, data):
+        start = (m.start() + 3) & ~3
+        end = m.end() & ~3
+        if end - start < min_gap:
+            continue
+        if start > pos:
+            runs.append((pos, data[pos:start]))
+        pos = end
+    if pos < len(data):
+        runs.append((pos, data[pos:]))
+    return runs
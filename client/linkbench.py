@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+
+# Loads the same image into the native bootloader through linksim.py
+# once per link profile and reports how long it took, the goodput and
+# how often the client had to go back and retransmit. With --fec it goes
+# through each profile once per redundancy (0 being retransmits only):
+#
+#   linkbench.py ../build-native/native-bootloader [--profile ber-4 ...] [--fec 0 --fec 8]
+
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+from bootloader import *
+from linksim import LinkSim, PROFILES
+
+# Where native/main.cpp puts the staging slot in the flash file
+STAGING_OFFSET = 0x140000
+BOARD_ID = 1
+
+def run(bootloader, link, data, port, seed, fast=True, fec=0):
+    flash = tempfile.NamedTemporaryFile()
+    proc = subprocess.Popen([bootloader, 'tcp:{}'.format(port), flash.name, str(BOARD_ID)],
+                            stdout=subprocess.DEVNULL)
+    try:
+        time.sleep(0.2)
+        sim = LinkSim(0, ('localhost', port), link, seed=seed).start()
+        board = Board(Port(None, 0, dev=SocketDev('localhost', sim.port)), BOARD_ID)
+        board.set_slot(Slot.STAGING)
+
+        start = time.time()
+        board.load(data, fast=fast, fec=fec)
+        elapsed = time.time() - start
+
+        with open(flash.name, 'rb') as fh:
+            fh.seek(STAGING_OFFSET + IMAGE_HEADER_SIZE)
+            good = fh.read(len(data)) == data
+        return elapsed, board.conn.bad_transmits, sim.stats, good
+    finally:
+        proc.kill()
+        proc.wait()
+
+if __name__=='__main__':
+    import argparse
+    parser = argparse.ArgumentParser()
+    parser.add_argument("bootloader", type=str, help="The native-bootloader binary")
+    parser.add_argument("--profile", action="append", choices=PROFILES.keys(),
+                        help="Profiles to run (all by default)")
+    parser.add_argument("--size", type=int, help="Bytes to load", default=16384)
+    parser.add_argument("--port", type=int, help="Port for the native bootloader", default=7100)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--slow", help="Load a msg at a time instead of streaming", action="store_true")
+    parser.add_argument("--fec", type=int, action="append",
+                        help="Writes per PARITY to try, 0 for none (the default)")
+    args = parser.parse_args()
+
+    data = random.Random(args.seed).randbytes(args.size)
+
+    print('{:8s} {:>4s} {:>8s} {:>10s} {:>6s} {:>6s} {:>6s} {:>6s}  {}'.format(
+        'profile', 'fec', 'time', 'goodput', 'bt', 'flips', 'drops', 'swaps', 'image'))
+    failed = False
+    port = args.port
+    for name in args.profile or PROFILES.keys():
+        for fec in args.fec or [0]:
+            elapsed, bad, stats, good = run(args.bootloader, PROFILES[name], data,
+                                            port, args.seed, not args.slow, fec)
+            port += 1
+            total = lambda k: stats['up'][k] + stats['down'][k]
+            print('{:8s} {:>4s} {:7.2f}s {:7.0f}B/s {:6d} {:6d} {:6d} {:6d}  {}'.format(
+                name, str(fec) if fec else '-', elapsed, len(data) / elapsed, bad,
+                total('bit_errors'), total('bytes_dropped'), total('reordered'),
+                'ok' if good else 'BAD'))
+            failed = failed or not good
+    sys.exit(1 if failed else 0)
@@ -0,0 +1,296 @@
+#!/usr/bin/env python3
+
+# A tcp proxy that behaves like a bad serial link: it limits the
+# bandwidth, delays, flips bits, drops bytes and whole frames and
+# swaps frames around, each direction on its own. Put it between the
+# client (--tcp) and the native bootloader (tcp:<port>):
+#
+#   native-bootloader tcp:7000 flash.bin 1 &
+#   linksim.py 7001 localhost:7000 --profile noisy &
+#   bootloader.py --tcp localhost:7001 --id 1 --load app.bin
+
+import heapq
+import math
+import random
+import socket
+import threading
+import time
+
+FRAME_LEN = 11
+
+class Link:
+    def __init__(self, bandwidth=0, latency=0, jitter=0, ber=0,
+                 byte_drop=0, frame_drop=0, reorder=0):
+        self.bandwidth = bandwidth # Bytes/s, 0 for unlimited
+        self.latency = latency # s
+        self.jitter = jitter # s, uniform on top of the latency
+        self.ber = ber # Bit error rate
+        self.byte_drop = byte_drop # Per byte
+        self.frame_drop = frame_drop # Per FRAME_LEN bytes
+        self.reorder = reorder # Per FRAME_LEN bytes, swapped with the next
+
+    def __repr__(self):
+        return 'Link({})'.format(', '.join('{}={}'.format(k, v)
+                for k, v in vars(self).items() if v))
+
+# Roughly a 921600 baud uart (10 bits a byte) with different troubles
+UART_BANDWIDTH = 92160
+PROFILES = {
+    'clean':   Link(UART_BANDWIDTH, latency=0.0005),
+    'ber-5':   Link(UART_BANDWIDTH, latency=0.0005, ber=1e-5),
+    'ber-4':   Link(UART_BANDWIDTH, latency=0.0005, ber=1e-4),
+    'drops':   Link(UART_BANDWIDTH, latency=0.0005, byte_drop=1e-4),
+    'frames':  Link(UART_BANDWIDTH, latency=0.0005, frame_drop=1e-3),
+    'reorder': Link(UART_BANDWIDTH, latency=0.0005, reorder=1e-3),
+    'far':     Link(UART_BANDWIDTH, latency=0.01, jitter=0.002),
+    'noisy':   Link(UART_BANDWIDTH, latency=0.002, jitter=0.0005, ber=2e-5,
+                    byte_drop=2e-5, frame_drop=2e-4, reorder=2e-4),
+}
+
+# Positions (out of n) hit with probability p each, without a draw per position
+def _hits(rng, n, p):
+    if p <= 0:
+        return
+    if p >= 1:
+        yield from range(n)
+        return
+    log_q = math.log(1 - p)
+    i = -1
+    while True:
+        i += 1 + int(math.log(1 - rng.random()) / log_q)
+        if i >= n:
+            return
+        yield i
+
+# Carries one direction: mangles what src sends (or what is fed in if
+# there's no src) and hands it to dst when it would have come out of
+# the far end of the link
+class _Pipe:
+    def __init__(self, link, src, dst, rng, stats):
+        self._link = link
+        self._src = src
+        self._dst = dst
+        self._rng = rng
+        self._stats = stats
+        self._queue = [] # (due, seq, data)
+        self._seq = 0
+        self._free_at = 0 # When the link is done with what it has
+        self._held = None # A frame being swapped with the next
+        self._cond = threading.Condition()
+        self._closed = False
+
+    def start(self):
+        threading.Thread(target=self._deliver, daemon=True).start()
+        if self._src is not None:
+            threading.Thread(target=self._receive, daemon=True).start()
+        return self
+
+    def _mangle(self, data):
+        link = self._link
+        data = bytearray(data)
+        for i in _hits(self._rng, 8 * len(data), link.ber):
+            data[i // 8] ^= 1 << (i % 8)
+            self._stats['bit_errors'] += 1
+        dropped = set(_hits(self._rng, len(data), link.byte_drop))
+        for f in _hits(self._rng, (len(data) + FRAME_LEN - 1) // FRAME_LEN, link.frame_drop):
+            dropped.update(range(f * FRAME_LEN, min(len(data), (f + 1) * FRAME_LEN)))
+            self._stats['frames_dropped'] += 1
+        self._stats['bytes_dropped'] += len(dropped)
+        if dropped:
+            data = bytearray(b for i, b in enumerate(data) if i not in dropped)
+        return bytes(data)
+
+    def _schedule(self, data):
+        link = self._link
+        now = time.time()
+        start = max(now, self._free_at)
+        self._free_at = start + (len(data) / link.bandwidth if link.bandwidth else 0)
+        due = self._free_at + link.latency + self._rng.random() * link.jitter
+        with self._cond:
+            # Keep the order (besides the swaps), jitter just bunches things up
+            if self._queue:
+                due = max(due, max(self._queue)[0])
+            heapq.heappush(self._queue, (due, self._seq, data))
+            self._seq += 1
+            self._cond.notify()
+
+    def feed(self, data):
+        self._stats['bytes'] += len(data)
+        # A frame at a time so that they can be swapped
+        for i in range(0, len(data), FRAME_LEN):
+            frame = self._mangle(data[i:i + FRAME_LEN])
+            if self._held is not None:
+                self._schedule(frame)
+                self._schedule(self._held)
+                self._held = None
+            elif self._rng.random() < self._link.reorder:
+                self._held = frame
+                self._stats['reordered'] += 1
+            else:
+                self._schedule(frame)
+
+    def end(self):
+        with self._cond:
+            self._closed = True
+            self._cond.notify()
+
+    def _receive(self):
+        while True:
+            try:
+                data = self._src.recv(4096)
+            except OSError:
+                data = b''
+            if not data:
+                break
+            self.feed(data)
+        self.end()
+
+    def _deliver(self):
+        while True:
+            with self._cond:
+                while not self._queue and not self._closed:
+                    self._cond.wait()
+                if not self._queue:
+                    break
+                due = self._queue[0][0]
+                wait = due - time.time()
+                if wait > 0:
+                    self._cond.wait(wait)
+                    continue
+                _, _, data = heapq.heappop(self._queue)
+            try:
+                self._dst.sendall(data)
+            except OSError:
+                break
+        try:
+            self._dst.shutdown(socket.SHUT_WR)
+        except OSError:
+            pass
+
+class LinkSim:
+    # up is client to board, down board to client
+    def __init__(self, port, target, up, down=None, seed=None):
+        self._target = target
+        self._up = up
+        self._down = down if down is not None else up
+        self._rng = random.Random(seed)
+        self._listen = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self._listen.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self._listen.bind(('localhost', port))
+        self._listen.listen(1)
+        self.port = self._listen.getsockname()[1]
+        self.stats = {'up': self._new_stats(), 'down': self._new_stats()}
+
+    @staticmethod
+    def _new_stats():
+        return {'bytes': 0, 'bit_errors': 0, 'bytes_dropped': 0,
+                'frames_dropped': 0, 'reordered': 0}
+
+    def start(self):
+        threading.Thread(target=self.serve, daemon=True).start()
+        return self
+
+    def serve(self):
+        while True:
+            client, _ = self._listen.accept()
+            board = socket.create_connection(self._target)
+            for s in (client, board):
+                s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            _Pipe(self._up, client, board, self._rng, self.stats['up']).start()
+            _Pipe(self._down, board, client, self._rng, self.stats['down']).start()
+
+# Like a can bus behind a gateway: what the client sends goes out to every
+# board, each over a link of its own (so each loses different frames), and
+# the boards' (whole) frames are merged on the way back without any loss
+class BusSim:
+    def __init__(self, port, targets, link, seed=None):
+        self._targets = targets
+        self._link = link
+        self._rng = random.Random(seed)
+        self._listen = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self._listen.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self._listen.bind(('localhost', port))
+        self._listen.listen(1)
+        self.port = self._listen.getsockname()[1]
+        self.stats = [LinkSim._new_stats() for _ in targets]
+        self._lock = threading.Lock()
+
+    def start(self):
+        threading.Thread(target=self.serve, daemon=True).start()
+        return self
+
+    def serve(self):
+        while True:
+            client, _ = self._listen.accept()
+            client.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            pipes = []
+            for target, stats in zip(self._targets, self.stats):
+                board = socket.create_connection(target)
+                board.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                pipes.append(_Pipe(self._link, None, board, self._rng, stats).start())
+                threading.Thread(target=self._merge, args=(board, client), daemon=True).start()
+            threading.Thread(target=self._fan_out, args=(client, pipes), daemon=True).start()
+
+    def _fan_out(self, client, pipes):
+        while True:
+            try:
+                data = client.recv(4096)
+            except OSError:
+                data = b''
+            if not data:
+                break
+            for pipe in pipes:
+                pipe.feed(data)
+        for pipe in pipes:
+            pipe.end()
+
+    # Passes on whole frames (see Frame.hpp) so they don't get interleaved
+    def _merge(self, board, client):
+        buf = bytearray()
+        while True:
+            try:
+                data = board.recv(4096)
+            except OSError:
+                data = b''
+            if not data:
+                break
+            buf += data
+            while buf:
+                if buf[0] == 0x04:
+                    if len(buf) < 4:
+                        break
+                    length = 4 + (buf[2] | (buf[3] << 8)) + 2
+                elif buf[0] in (0x02, 0x03):
+                    length = FRAME_LEN
+                else:
+                    length = 1
+                if len(buf) < length:
+                    break
+                with self._lock:
+                    client.sendall(bytes(buf[:length]))
+                del buf[:length]
+
+if __name__=='__main__':
+    import argparse
+    parser = argparse.ArgumentParser()
+    parser.add_argument("port", type=int, help="The port to listen on")
+    parser.add_argument("target", type=str, help="host:port of the native bootloader")
+    parser.add_argument("--profile", choices=PROFILES.keys(), default="clean")
+    parser.add_argument("--bandwidth", type=float, help="Bytes/s (overrides the profile)")
+    parser.add_argument("--latency", type=float, help="Seconds (overrides the profile)")
+    parser.add_argument("--jitter", type=float, help="Seconds (overrides the profile)")
+    parser.add_argument("--ber", type=float, help="Bit error rate (overrides the profile)")
+    parser.add_argument("--byte_drop", type=float, help="Byte loss rate (overrides the profile)")
+    parser.add_argument("--frame_drop", type=float, help="Frame loss rate (overrides the profile)")
+    parser.add_argument("--reorder", type=float, help="Frame swap rate (overrides the profile)")
+    parser.add_argument("--seed", type=int, default=None)
+    args = parser.parse_args()
+
+    link = Link(**vars(PROFILES[args.profile]))
+    for k in vars(link):
+        if getattr(args, k) is not None:
+            setattr(link, k, getattr(args, k))
+
+    host, _, port = args.target.rpartition(':')
+    print('{} -> {}: {}'.format(args.port, args.target, link))
+    LinkSim(args.port, (host or 'localhost', int(port)), link, seed=args.seed).serve()
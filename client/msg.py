@@ -2,7 +2,13 @@ import time
 import struct
 from enum import Enum
 import math
+import socket
+import collections
 import serial
+try:
+    import numpy
+except ImportError:
+    numpy = None
 
 DEBUG=False
 USE_CHECKSUM=True
@@ -37,11 +43,51 @@ class CmdType(AutoNumberEnum):
     POSITION = ()
     READ = ()
     WRITE = ()
+    IMAGE_INFO = ()
+    SET_SLOT = ()
+    BATCH = ()
+    READ_STREAM = ()
+    BLANK_CHECK = ()
+    SET_BAUD = ()
+    GROUP_JOIN = ()
+    GROUP_BLOCK = ()
+    GROUP_WRITE = ()
+    GROUP_MISSING = ()
+    PARITY = ()
+
+# Note: Keep in line with Msg::MAX_BATCH
+MAX_BATCH = 16
+# And with Msg::GROUP_BLOCK_SIZE/MAX_GROUP_BLOCKS
+GROUP_BLOCK_SIZE = 256
+MAX_GROUP_BLOCKS = 4096
+# And with Msg::MIN_GROUP_ID
+MIN_GROUP_ID = 0x80
+# And with Msg::MAX_FEC_GROUP
+MAX_FEC_GROUP = 16
+
+class ImageField(Enum):
+    SIZE = 0
+    CRC = 1
+    VERSION = 2
+    BUILD_HASH = 3
+
+# Note: Keep in line with Image.hpp!
+IMAGE_HEADER_SIZE = 0x200
+IMAGE_MAGIC = 0x474D4942
+# Where the SHA-256 of the image goes, after the verified flag
+IMAGE_DIGEST_OFFSET = 24
+# Where the app slot starts (APP_START in main.cpp), images run from
+# right after its header (staged ones get installed there)
+APP_START = 0x08080000
 
 class Mode(Enum):
     APP = 0
     BOOTLOADER = 1
 
+class Slot(Enum):
+    APP = 0
+    STAGING = 1
+
 def fletcher16(data):
     sum1 = 0
     sum2 = 0
@@ -50,6 +96,10 @@ def fletcher16(data):
         sum2 = (sum2 + sum1) % 255
     return (sum2 << 8) | sum1
 
+# Sent with the 0x02 header, which the board syncs back up to after a bad frame
+RESYNC_CMDS = (CmdType.STATUS.value, CmdType.ACK.value, CmdType.GROUP_BLOCK.value,
+               CmdType.PARITY.value)
+
 def pack_msg(cmd):
     board_id = cmd['board_id']
     c = cmd['cmd']
@@ -65,8 +115,7 @@ def pack_msg(cmd):
     if 'value' in cmd and cmd['value'] is not None:
         payload = struct.pack('<L', cmd['value'])
 
-    header = 0x02 if c == CmdType.STATUS.value or \
-                     c == CmdType.ACK.value else 0x03
+    header = 0x02 if c in RESYNC_CMDS else 0x03
 
     packet = struct.pack('<BBBB', board_id, c, length, seq_num) + payload
     tail = struct.pack('<H', fletcher16(packet)) if USE_CHECKSUM else bytes()
@@ -74,19 +123,104 @@ def pack_msg(cmd):
     packet = bytes([header])  + packet + tail
     return packet
 
+# Whether packet is a whole frame with a good header and checksum
+def valid_msg(packet):
+    if len(packet) != PACKET_LEN or packet[0] not in (0x02, 0x03):
+        return False
+    if USE_CHECKSUM and fletcher16(packet[1:9]) != struct.unpack('<H', packet[9:11])[0]:
+        return False
+    return True
+
+# The frames of consecutive (from seq_num on) sequenced msgs of type cmd
+# with data (padded to a multiple of 4) as their 4 byte payloads, in
+# one go. The checksums are worked out from the byte weights: sum1 is
+# the sum of the 8 bytes, sum2 weighs them 8 down to 1. length goes
+# into every frame as is (GROUP_WRITE puts the block there)
+def encode_frames(board_id, cmd, seq_num, data, length=4):
+    if isinstance(cmd, CmdType):
+        cmd = cmd.value
+    data = bytes(data) + bytes(-len(data) % 4)
+    n = len(data) // 4
+    header = 0x02 if cmd in RESYNC_CMDS else 0x03
+    if numpy is not None:
+        packets = numpy.empty((n, 8), dtype=numpy.uint8)
+        packets[:, 0] = board_id
+        packets[:, 1] = cmd
+        packets[:, 2] = length
+        packets[:, 3] = (seq_num + numpy.arange(n)) % 256
+        packets[:, 4:] = numpy.frombuffer(data, dtype=numpy.uint8).reshape(n, 4)
+        wide = packets.astype(numpy.uint32)
+        frames = numpy.empty((n, PACKET_LEN), dtype=numpy.uint8)
+        frames[:, 0] = header
+        frames[:, 1:9] = packets
+        if USE_CHECKSUM:
+            frames[:, 9] = wide.sum(axis=1) % 255
+            frames[:, 10] = wide.dot(numpy.arange(8, 0, -1, dtype=numpy.uint32)) % 255
+        return frames.tobytes()
+
+    frames = bytearray(n * PACKET_LEN)
+    base1 = board_id + cmd + length
+    base2 = 8 * board_id + 7 * cmd + 6 * length
+    for i in range(n):
+        seq = (seq_num + i) % 256
+        d0, d1, d2, d3 = data[4 * i:4 * i + 4]
+        frame = bytes([header, board_id, cmd, length, seq, d0, d1, d2, d3])
+        if USE_CHECKSUM:
+            frame += bytes([(base1 + seq + d0 + d1 + d2 + d3) % 255,
+                            (base2 + 5 * seq + 4 * d0 + 3 * d1 + 2 * d2 + d3) % 255])
+        frames[i * PACKET_LEN:(i + 1) * PACKET_LEN] = frame
+    return bytes(frames)
+
+# Puts a PARITY (see Msg::PARITY) after every fec frames of frames (from
+# encode_frames(board_id, cmd, seq_num, data)) and after the last ones
+def add_parity(frames, board_id, seq_num, data, fec):
+    data = bytes(data) + bytes(-len(data) % 4)
+    words = [w for w, in struct.iter_unpack('<L', data)]
+    out = bytearray()
+    for first in range(0, len(words), fec):
+        group = words[first:first + fec]
+        parity = 0
+        for w in group:
+            parity ^= w
+        out += frames[first * PACKET_LEN:(first + len(group)) * PACKET_LEN]
+        out += encode_frames(board_id, CmdType.PARITY, (seq_num + first) % 256,
+                             struct.pack('<L', parity), length=len(group))
+    return bytes(out)
+
 def unpack_msg(packet):
     header, board_id, c, length, seq_num = struct.unpack('<BBBBB', packet[:5])
     payload = packet[5:9]
     value = struct.unpack('<L', payload)[0]
     return {'board_id': board_id, 'cmd': CmdType(c), 'length': length,
             'seq_num': seq_num, 'payload': payload, 'value': value}
+# How long the board waits for a frame at a new baud rate before going back
+BAUD_FALLBACK = 0.5
+
 class Port:
-    def __init__(self, port, baud):
-        self._dev = serial.Serial(port, baud, timeout=None)
+    # dev stands in for the serial port if given (i.e. a SocketDev)
+    def __init__(self, port, baud, dev=None):
+        self._dev = dev if dev is not None else serial.Serial(port, baud, timeout=None)
+
+    @property
+    def baud(self):
+        return self._dev.baudrate
+
+    def set_baud(self, baud):
+        self._dev.flush()
+        self._dev.baudrate = baud
+        self._dev.reset_input_buffer()
 
     def reset_read_buffer(self):
         self._dev.reset_input_buffer()
 
+    # Throws away whatever comes in until the line goes quiet
+    def drain(self, quiet=0.05):
+        while True:
+            time.sleep(quiet)
+            if self._dev.in_waiting == 0:
+                break
+            self._dev.reset_input_buffer()
+
     def try_read(self):
         if self._dev.in_waiting < 9:
             return None
@@ -103,14 +237,181 @@ class Port:
                 return None
         packet = self._dev.read(PACKET_LEN)
         if DEBUG: print('r {}'.format(packet.hex()))
+        # A mangled reply is as good as a lost one, the
+        # status() that follows gets things back in line
+        if not valid_msg(packet):
+            return None
         return unpack_msg(packet)
 
+    # Reads the data of a bulk frame, or of a READ msg (what a
+    # stream relayed by another board turns into), None on a bad frame
+    def read_bulk(self, timeout=1):
+        t = time.time()
+        while self._dev.in_waiting < 1:
+            if time.time() - t > timeout:
+                return None
+        header = self._dev.read(1)[0]
+        if header == 0x04:
+            head = self._dev.read(3)
+            length = struct.unpack('<H', head[1:])[0]
+            data = self._dev.read(length)
+            checksum = struct.unpack('<H', self._dev.read(2))[0]
+            if DEBUG: print('r bulk {} bytes'.format(length))
+            return data if fletcher16(head + data) == checksum else None
+        if header == 0x03:
+            msg = unpack_msg(bytes([header]) + self._dev.read(PACKET_LEN - 1))
+            if msg['cmd'] == CmdType.READ:
+                return msg['payload'][:msg['length']]
+        return None
+
     def write(self, msg):
         packet = pack_msg(msg)
         if DEBUG: print('w {}'.format(packet.hex()))
         self._dev.write(packet)
         self._dev.flush()
 
+    # Already encoded frames (see encode_frames)
+    def write_frames(self, frames):
+        if DEBUG: print('w {} frames'.format(len(frames) // PACKET_LEN))
+        self._dev.write(frames)
+        self._dev.flush()
+
+# Looks enough like a serial.Serial for Port to run the uart framing over
+# tcp, i.e. to the native bootloader's tcp:<port> or through linksim.py
+class SocketDev:
+    def __init__(self, host, port, timeout=1):
+        self._sock = socket.create_connection((host, port))
+        self._sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self._sock.setblocking(False)
+        self._buf = bytearray()
+        self.timeout = timeout
+        self.baudrate = 0
+
+    def _fill(self):
+        try:
+            while True:
+                data = self._sock.recv(65536)
+                if not data:
+                    raise IOError('Connection closed')
+                self._buf += data
+        except BlockingIOError:
+            pass
+
+    @property
+    def in_waiting(self):
+        self._fill()
+        return len(self._buf)
+
+    # Like the serial port, short if nothing more comes in time
+    def read(self, n):
+        t = time.time()
+        while self.in_waiting < n and time.time() - t < self.timeout:
+            time.sleep(0.0001)
+        data = bytes(self._buf[:n])
+        del self._buf[:n]
+        return data
+
+    def write(self, data):
+        self._sock.setblocking(True)
+        self._sock.sendall(data)
+        self._sock.setblocking(False)
+
+    def flush(self):
+        pass
+
+    def reset_input_buffer(self):
+        self._fill()
+        self._buf.clear()
+
+    def close(self):
+        self._sock.close()
+
+# The same interface over udp (see Udp.hpp), frames are held back and
+# sent together (up to UDP_MAX_FRAMES per datagram) once a reply is read
+UDP_FRAMES = 0x03
+UDP_BULK = 0x04
+UDP_MAX_FRAMES = 64
+UDP_DEFAULT_PORT = 6969
+
+class UdpPort:
+    def __init__(self, host, port=UDP_DEFAULT_PORT):
+        self._sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self._sock.connect((host, port))
+        self._pending = []
+        self._frames = collections.deque()
+        self._bulk = collections.deque()
+
+    def _send(self):
+        if self._pending:
+            self._sock.send(bytes([UDP_FRAMES]) + b''.join(self._pending))
+            self._pending = []
+
+    # Takes in one datagram, False if there was none in time
+    def _receive(self, timeout):
+        self._send()
+        self._sock.settimeout(timeout if timeout > 0 else None)
+        try:
+            data = self._sock.recv(65536)
+        except (socket.timeout, ConnectionRefusedError):
+            return False
+        if DEBUG: print('r {}'.format(data.hex()))
+        if len(data) >= 4 and data[0] == UDP_BULK:
+            length = struct.unpack('<H', data[2:4])[0]
+            self._bulk.append(data[4:4 + length])
+        elif len(data) >= 1 and data[0] == UDP_FRAMES:
+            for i in range(1, len(data) - 7, 8):
+                self._frames.append(data[i:i + 8])
+        return True
+
+    def reset_read_buffer(self):
+        self._frames.clear()
+        self._bulk.clear()
+
+    def drain(self, quiet=0.05):
+        while self._receive(quiet):
+            pass
+        self.reset_read_buffer()
+
+    def try_read(self):
+        if not self._frames and not self._receive(0.001):
+            return None
+        return self.read(0.001)
+
+    def read(self, timeout=-1):
+        t = time.time()
+        while not self._frames:
+            left = timeout - (time.time() - t) if timeout > 0 else -1
+            if timeout > 0 and left <= 0:
+                return None
+            self._receive(left)
+        return unpack_msg(bytes([0x03]) + self._frames.popleft())
+
+    def read_bulk(self, timeout=1):
+        t = time.time()
+        while not self._bulk and not self._frames:
+            left = timeout - (time.time() - t)
+            if left <= 0 or not self._receive(left):
+                return None
+        if self._bulk:
+            return self._bulk.popleft()
+        msg = unpack_msg(bytes([0x03]) + self._frames.popleft())
+        if msg['cmd'] == CmdType.READ:
+            return msg['payload'][:msg['length']]
+        return None
+
+    def write(self, msg):
+        packet = pack_msg(msg)[1:9]
+        if DEBUG: print('w {}'.format(packet.hex()))
+        self._pending.append(packet)
+        if len(self._pending) == UDP_MAX_FRAMES:
+            self._send()
+
+    def write_frames(self, frames):
+        for i in range(0, len(frames), PACKET_LEN):
+            self._pending.append(frames[i + 1:i + 9])
+            if len(self._pending) == UDP_MAX_FRAMES:
+                self._send()
+
 class Status(Enum):
     OUTSTANDING = 0
     COMPLETE = 1
@@ -125,6 +426,7 @@ class Conn:
 
         self._bad_transmits = 0
         self._quiet_time = 0.0002
+        self._status_tag = 0
         self._seq_num = self.status()
 
         # Should not be longer than 255
@@ -141,6 +443,10 @@ class Conn:
         pass
         #self._quiet_time = max(0.000001, self._quiet_time * 0.99)
 
+    @property
+    def port(self):
+        return self._port
+
     @property
     def transmission_interval(self):
         return self._quiet_time
@@ -153,23 +459,56 @@ class Conn:
     def bad_transmits(self):
         return self._bad_transmits
 
+    # Status requests carry a tag (in the seq num, which the board
+    # doesn't check for them) that the ack echoes, so an ack
+    # that shows up late isn't taken for the current one
+    def _status_msg(self):
+        self._status_tag = (self._status_tag + 1) % 256
+        return {'board_id': self._id, 'cmd': CmdType.STATUS, 'seq_num': self._status_tag}
+
     def status(self):
-        msg = {'board_id': self._id, 'cmd': CmdType.STATUS}
+        msg = self._status_msg()
         time.sleep(2*self._quiet_time)
         self._port.write(msg)
-        ack = self._port.read(timeout=0.002)
+        ack = self._read_reply(msg['seq_num'], 0.002, ack=True)
 
-        if ack is None or ack['cmd'] != CmdType.ACK:
+        if ack is None:
             quiet_time = self._quiet_time
+            # An ack to an earlier try is as good, so
+            # keep listening for those as well
             while ack is None:
                 if DEBUG: print('failed to get status')
                 time.sleep(quiet_time)
-                self._port.reset_read_buffer()
                 quiet_time = 2 * quiet_time
                 self._port.write(msg)
-                ack = self._port.read(timeout=0.002)
+                ack = self._read_reply(msg['seq_num'], max(0.002, quiet_time), ack=True)
         return ack['payload'][3]
 
+    # Like status() but gives up (returning None) after a few tries
+    def try_status(self, tries=5, timeout=0.02):
+        msg = self._status_msg()
+        for _ in range(tries):
+            self._port.reset_read_buffer()
+            self._port.write(msg)
+            ack = self._read_reply(msg['seq_num'], timeout, ack=True)
+            if ack is not None:
+                return ack['payload'][3]
+        return None
+
+    # The reply (the ack if ack) to the msg sent with seq_num, skipping
+    # whatever is left over from before (replies that were given up
+    # on) or from other boards on the bus, None if it doesn't come in time
+    def _read_reply(self, seq_num, timeout, ack=False):
+        t = time.time()
+        while True:
+            left = timeout - (time.time() - t)
+            if left <= 0:
+                return None
+            msg = self._port.read(timeout=left)
+            if msg is not None and (msg['cmd'] == CmdType.ACK) == ack and \
+                    msg['seq_num'] == seq_num and msg['board_id'] == self._id:
+                return msg
+
     def write(self, cmd, payload=None, value=None):
         action = { 'status': Status.OUTSTANDING }
 
@@ -189,7 +528,9 @@ class Conn:
         action['run'] = write_action
         self.do(action)
 
-    def query(self, cmd, payload=None, value=None, timeout=1):
+    # after (if given) is run on the reply before anything else is
+    # sent, for replies that are followed by more (i.e. a stream)
+    def query(self, cmd, payload=None, value=None, timeout=1, after=None):
         action = { 'status': Status.OUTSTANDING }
 
         result = None
@@ -202,7 +543,9 @@ class Conn:
             self._port.write(msg)
 
             nonlocal result
-            result = self._port.read(timeout=timeout)
+            result = self._read_reply(self._seq_num, timeout)
+            if after is not None and result is not None:
+                after(result)
 
             action['seq_num'] = self._seq_num
             action['status'] = Status.SUCCESS if result is not None else Status.FAILURE
@@ -214,6 +557,121 @@ class Conn:
 
         return result
 
+    # Sends ops (a list of (cmd, payload, value)) as a single batch,
+    # returns the combined reply
+    def batch(self, ops, timeout=1):
+        if len(ops) == 0 or len(ops) > MAX_BATCH:
+            raise ValueError('Batches take 1 to {} ops'.format(MAX_BATCH))
+        action = { 'status': Status.OUTSTANDING }
+
+        result = None
+
+        def batch_action():
+            msgs = [{'cmd': CmdType.BATCH, 'payload': [len(ops), 0, 0, 0], 'value': None}]
+            msgs += [{'cmd': c, 'payload': p, 'value': v} for c, p, v in ops]
+            for msg in msgs:
+                msg['board_id'] = self._id
+                msg['seq_num'] = self._seq_num
+                time.sleep(self._quiet_time)
+                self._port.write(msg)
+                action['seq_num'] = self._seq_num
+                self._seq_num = (self._seq_num + 1) % 256
+
+            nonlocal result
+            result = self._read_reply(action['seq_num'], timeout)
+            action['status'] = Status.SUCCESS if result is not None else Status.FAILURE
+
+        action['run'] = batch_action
+        self.do(action)
+
+        return result
+
+    # Sends data as consecutive (unacked) cmds with 4 bytes each, the
+    # frames encoded up front and written chunk frames at a time. A status
+    # request follows each chunk, up to window frames are out before the
+    # oldest is acked. A short ack (the board is still waiting on an
+    # earlier seq num) goes back to that frame. callback gets the words
+    # acked so far and the total. With fec (up to MAX_FEC_GROUP, only
+    # for WRITE) a PARITY goes out after every fec frames, so the board
+    # can make up for one of them getting lost without going back
+    def write_stream(self, cmd, data, window=128, chunk=32, timeout=0.1,
+                     callback=lambda i, n: None, fec=0):
+        if window + fec >= 256:
+            raise ValueError('The window has to be smaller than the seq num range')
+        if fec and (fec > MAX_FEC_GROUP or cmd != CmdType.WRITE):
+            raise ValueError('PARITY is for groups of up to {} WRITEs'.format(MAX_FEC_GROUP))
+        if self._outstanding:
+            self.flush()
+        start = self._seq_num
+        frames = encode_frames(self._id, cmd, start, data)
+        n = len(frames) // PACKET_LEN
+        if fec:
+            frames = add_parity(frames, self._id, start, data, fec)
+
+        # Where frame i starts, the PARITYs come after their groups
+        def offset(i):
+            if i == n:
+                return len(frames)
+            return (i + (i // fec if fec else 0)) * PACKET_LEN
+
+        acked = 0
+        sent = 0
+        pending = collections.deque() # (status tag, frames sent before it)
+        while acked < n:
+            while sent < n and sent - acked < window:
+                end = min(n, sent + chunk, acked + window)
+                # Whole groups, so that the status doesn't overtake a PARITY
+                if fec and end < n:
+                    end = max(end - end % fec, min(n, sent - sent % fec + fec))
+                self._port.write_frames(frames[offset(sent):offset(end)])
+                sent = end
+                status = self._status_msg()
+                self._port.write(status)
+                pending.append((status['seq_num'], sent))
+
+            tag, end = pending.popleft()
+            ack = self._read_reply(tag, timeout, ack=True)
+            next_seq = ack['payload'][3] if ack is not None else self.status()
+            # Less than the window, so the difference is unambiguous
+            received = (next_seq - (start + acked)) % 256
+            if ack is not None and acked + received >= end:
+                acked = end
+            else:
+                self._bad_transmission()
+                if DEBUG: print('going back to frame {}'.format(acked + received))
+                # (the acks still to come are for frames that will be resent)
+                acked = min(sent, acked + received)
+                sent = acked
+                pending.clear()
+            callback(acked, n)
+
+        self._seq_num = (start + n) % 256
+
+    # Streams length bytes from the current position, stops
+    # short at the first bad or missing frame
+    def read_stream(self, length, timeout=1):
+        data = bytes()
+        refused = False
+
+        def collect(msg):
+            nonlocal data, refused
+            data = bytes()
+            refused = msg['cmd'] == CmdType.ERROR
+            if msg['cmd'] != CmdType.OKAY:
+                return
+            while len(data) < msg['value']:
+                chunk = self._port.read_bulk(timeout)
+                if chunk is None:
+                    # The rest of it is still coming
+                    self._port.drain()
+                    break
+                data = data + chunk
+
+        self.query(CmdType.READ_STREAM, value=length, after=collect)
+        if refused:
+            raise IOError('Can only stream from within the slot')
+        return data[:length]
+
     def do(self, action):
         if action['status'] != Status.SUCCESS:
             self._outstanding.append(action)
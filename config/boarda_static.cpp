@@ -0,0 +1,11 @@
+#define BOARD_ID 0
+
+#define CONF\
+    Uart uart(PD9, PD8, 921600);\
+    Can can(PD0, PD1, 500000);
+
+#define CONTEXT\
+    StaticContext<Uart, Can> ctx((uint8_t*) APP_START, (uint8_t*) STAGING_START, SLOT_SIZE,\
+                                 BOARD_ID, uart, can);
+
+#include "../src/main.cpp"
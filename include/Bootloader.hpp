@@ -5,6 +5,7 @@
 #include <array>
 
 #include "Buffer.hpp"
+#include "Image.hpp"
 
 namespace bootloader {
     typedef uint8_t board_id;
@@ -17,19 +18,28 @@ namespace bootloader {
     Mode getMode();
     void setMode(Mode m);
 
+    // The app runs out of the APP slot, updates can be written
+    // into the STAGING slot and get installed on the next boot
+    enum class Slot {
+        APP = 0,
+        STAGING = 1
+    };
+
     class Msg {
     public:
         // An 8-byte serialized
-        // representation of this class
+        // representation of this class,
+        // also how it is stored
         union Packet {
             struct {
                 uint8_t id;
                 uint8_t type;
                 uint8_t length; // Payload length
                 uint8_t seqNum; // A sequence number to detect dropped packets
-                uint8_t data[4]; // The data
+                std::array<uint8_t, 4> data; // The data
             } fields;
             uint8_t buffer[8]; // The original buffer
+            uint32_t words[2]; // As the can data registers hold it
         };
 
         enum Type {
@@ -73,80 +83,146 @@ namespace bootloader {
             MOVE_START, // Will send back move position in OKAY
             POSITION, // Will send back postion in OKAY
             READ, // Will send back data in OKAY
-            WRITE // Will not send anything back
+            WRITE, // Will not send anything back
+
+            // image header control
+            IMAGE_INFO, // Will send back the field in data[0] of a valid image
+                        // header in OKAY (see ImageField), ERROR if there is none
+
+            // Selects the slot (in data[0]) that MOVE_START, ERASE, WRITE and
+            // IMAGE_INFO work on, sends back the slot start in OKAY
+            SET_SLOT,
+
+            // The next data[0] (up to MAX_BATCH) sequenced messages are
+            // held and then run in order, stopping at the first ERROR.
+            // Sends back the last reply (OKAY if there was none) or
+            // ERROR with the failed index in data[0] and its data[0] in
+            // data[1]. A new BATCH drops a partially received one
+            BATCH,
+
+            // Sends back the value (a length) in OKAY, then streams that many
+            // bytes from the position (see Conn::writeBulk) and moves past them.
+            // ERROR if they don't all lie within the slot
+            READ_STREAM,
+
+            // Checks the sectors covering the value (a length) from the slot
+            // start, sends back in OKAY a mask of the blank ones in data[0..2]
+            // (bit 0 being the one at the slot start) and their number in data[3]
+            BLANK_CHECK,
+
+            // Switches the connection it came in on to the baud rate in the
+            // value once the OKAY is out (at the old rate), ERROR if it can't
+            // hit that rate. Goes back to the old rate unless a good frame
+            // comes in at the new one within BAUD_FALLBACK_MS. Not in a BATCH
+            SET_BAUD,
+
+            // Multicast writes: a board joins group data[0] (0 leaves, else
+            // at least MIN_GROUP_ID so it can't be another board's id) for
+            // data[1..2] (little-endian) blocks of GROUP_BLOCK_SIZE bytes from
+            // the position, which has to be in the slot being written.
+            // Sends back the position in OKAY. Frames sent to the group id
+            // are then taken by every member (and forwarded) without seq
+            // num checks or replies:
+            GROUP_JOIN,
+            // Starts block value, members that have it already ignore it. Has
+            // the 0x02 header on the uart, so a member that lost sync picks
+            // up again at the next block rather than the next STATUS
+            GROUP_BLOCK,
+            // Word seqNum (0 to GROUP_BLOCK_WORDS - 1) of the block, length
+            // has the block's low 8 bits so words of a block whose
+            // GROUP_BLOCK went missing aren't taken for the last one's
+            GROUP_WRITE,
+            // Sends back the number of blocks not received completely yet in
+            // OKAY, then streams a bitmap of them (bit n of byte n / 8 being
+            // block n, see Conn::writeBulk). ERROR if the written blocks
+            // couldn't be programmed, or if this connection didn't join
+            GROUP_MISSING,
+
+            // Forward error correction for streamed WRITEs: the value is the
+            // xor of the values of the length (up to MAX_FEC_GROUP) WRITEs
+            // from seqNum on. A single one of them that went missing is
+            // rebuilt from the others, so WRITEs past a gap are held (up to
+            // Context::FEC_WINDOW ahead) rather than dropped until the PARITY
+            // is in. Not sequence controlled, sends nothing back. Has the
+            // 0x02 header on the uart
+            PARITY
         };
 
-        inline constexpr Msg(board_id id, Type type, uint8_t seqNum, uint8_t len,
-                                const std::array<uint8_t, 4> &data) : _boardId(id), _type(type),
-                                                                      _seqNum(seqNum), _length(len),
-                                                                      _data(data), _error(false) {}
-        inline constexpr Msg() : _boardId(0), _type(INVALID), _seqNum(0), _length(0), _data(),
-                                 _error(false) {}
-        inline constexpr Msg(bool error) : _boardId(0), _type(INVALID), _seqNum(0), _length(0), _data(),
-                                           _error(error) {}
+        static constexpr uint32_t BAUD_FALLBACK_MS = 500;
+
+        static constexpr uint8_t MAX_BATCH = 16;
+
+        static constexpr size_t GROUP_BLOCK_SIZE = 256;
+        static constexpr size_t GROUP_BLOCK_WORDS = GROUP_BLOCK_SIZE / 4;
+        static constexpr size_t MAX_GROUP_BLOCKS = 4096;
+        // Ids from here on are groups, board ids stay below
+        static constexpr board_id MIN_GROUP_ID = 0x80;
 
-        inline uint8_t getSeqNum() const { return _seqNum; }
-        inline void setSeqNum(uint8_t seq) { _seqNum = seq; }
+        static constexpr uint8_t MAX_FEC_GROUP = 16;
+
+        enum ImageField {
+            IMAGE_SIZE = 0,
+            IMAGE_CRC = 1,
+            IMAGE_VERSION = 2,
+            IMAGE_BUILD_HASH = 3
+        };
+
+        inline Msg(board_id id, Type type, uint8_t seqNum, uint8_t len,
+                    const std::array<uint8_t, 4> &data) : _error(false) {
+            _p.fields.id = id; _p.fields.type = type;
+            _p.fields.seqNum = seqNum; _p.fields.length = len;
+            _p.fields.data = data;
+        }
+        inline Msg() : _error(false) { _p.words[0] = 0; _p.words[1] = 0; }
+        inline Msg(bool error) : _error(error) { _p.words[0] = 0; _p.words[1] = 0; }
+        inline Msg(const Packet& p) : _p(p), _error(false) {}
+
+        inline uint8_t getSeqNum() const { return _p.fields.seqNum; }
+        inline void setSeqNum(uint8_t seq) { _p.fields.seqNum = seq; }
 
         inline void setError(bool error) { _error = error; }
         inline bool hasError() const { return _error; }
 
-        inline void setID(board_id id) { _boardId = id; }
-        inline board_id getID() const { return _boardId; }
+        inline void setID(board_id id) { _p.fields.id = id; }
+        inline board_id getID() const { return _p.fields.id; }
 
-        inline void setType(Type type) { _type = type; }
-        inline Type getType() const { return _type; }
+        inline void setType(Type type) { _p.fields.type = type; }
+        inline Type getType() const { return static_cast<Type>(_p.fields.type); }
 
-        inline void setLength(uint8_t length) { _length = length; }
-        inline uint8_t getLength() const { return _length; }
+        inline void setLength(uint8_t length) { _p.fields.length = length; }
+        inline uint8_t getLength() const { return _p.fields.length; }
 
-        inline const std::array<uint8_t, 4>& getData() const { return _data; }
-        inline const uint8_t& getData(size_t idx) const { return _data[idx]; }
-        inline uint8_t& getData(size_t idx) { return _data[idx]; }
+        inline const std::array<uint8_t, 4>& getData() const { return _p.fields.data; }
+        inline const uint8_t& getData(size_t idx) const { return _p.fields.data[idx]; }
+        inline uint8_t& getData(size_t idx) { return _p.fields.data[idx]; }
 
-        inline void setData(size_t idx, uint8_t val) { _data[idx] = val; }
-        inline void setData(const std::array<uint8_t, 4>&d) { _data = d; }
+        inline void setData(size_t idx, uint8_t val) { _p.fields.data[idx] = val; }
+        inline void setData(const std::array<uint8_t, 4>&d) { _p.fields.data = d; }
 
         // Sets a single little-endian value
+        // (the data is the second word, both ends are little-endian)
         inline void setValue(uint32_t data) {
-            _data[0] = data & 0xFF; _data[1] = data >> 8 & 0xFF;
-            _data[2] = data >> 16 & 0xFF; _data[3] = data >> 24 & 0xFF;
+            _p.words[1] = data;
         }
         // Gets a single little-endian value
         inline uint32_t getValue() const {
-            return (uint32_t) _data[0] | ((uint32_t) _data[1] << 8) |
-                   ((uint32_t) _data[2] << 16) | ((uint32_t) _data[3] << 24);
+            return _p.words[1];
         }
 
         // For serialization/deserialization
-        inline Packet pack() const {
-            Packet p;
-            p.fields.id = static_cast<uint8_t>(_boardId);
-            p.fields.type = static_cast<uint8_t>(_type);
-            p.fields.seqNum = _seqNum;
-            p.fields.length = _length;
-            p.fields.data[0] = _data[0];
-            p.fields.data[1] = _data[1];
-            p.fields.data[2] = _data[2];
-            p.fields.data[3] = _data[3];
-            return p;
+        inline const Packet& pack() const {
+            return _p;
+        }
+        inline Packet& packet() {
+            return _p;
         }
         inline void unpack(const Packet& p) {
-            _boardId = static_cast<board_id>(p.fields.id);
-            _type = static_cast<Type>(p.fields.type);
-            _seqNum = p.fields.seqNum;
-            _length = p.fields.length;
-            _data = {p.fields.data[0], p.fields.data[1],
-                     p.fields.data[2], p.fields.data[3]};
+            _p = p;
             _error = false;
         }
 
     private:
-        board_id _boardId;
-        Type _type;
-        uint8_t _seqNum;
-        uint8_t _length;
-        std::array<uint8_t, 4> _data;
+        Packet _p;
         bool _error; // For read error, not actually part of the message
     };
 
@@ -162,39 +238,263 @@ namespace bootloader {
 
         virtual bool hasData() const = 0;
 
-        // Free space in the read queue
+        // Free space in the read queue (in messages)
         virtual size_t getReadWindow() const = 0;
-        // Free space in the write queue
+        // Free space in the write queue (in messages)
         virtual size_t getWriteWindow() const = 0;
 
         virtual void flush() = 0;
 
         virtual Conn& operator>>(Msg &r) = 0; // Read
         virtual Conn& operator<<(const Msg &w) = 0; // Write
+
+        // Zero copy reads: a transport can hand out its next message
+        // where it sits in the read queue (nullptr if it can't or has
+        // none), it stays valid until release()
+        virtual const Msg* peek() { return nullptr; }
+        virtual void release() {}
+
+        // Sends a block of memory without sequence control, by default
+        // as READ messages of up to 4 bytes each (length says how many)
+        virtual void writeBulk(board_id id, const uint8_t* data, size_t len);
+
+        // For SET_BAUD, only transports with a baud rate have these: whether
+        // the rate can be hit closely enough, and switching to it once what
+        // is queued has gone out (see Msg::SET_BAUD for the fallback)
+        virtual bool baudValid(uint32_t baud) const { return false; }
+        virtual void setBaud(uint32_t baud) {}
     };
 
+    // Also usable from the app (link bootloader_stm32f777vi) to take
+    // updates while running: construct it with a null appStart so only
+    // the staging slot can be written, then call poll() from the main
+    // loop, or use task() as the entry of a low priority (FreeRTOS) task.
+    // The client then sets the mode to APP and resets, and the bootloader
+    // installs the staged image on the way up. Note the app stalls while
+    // flash is being erased/programmed (single bank)
+    //
+    // Frames for other boards are forwarded between the words being
+    // programmed and the sectors being erased too (see flash::set_idle_hook,
+    // and StaticContext for during an erase), with a queue per conn for
+    // what it has no room for yet. Frames for us
+    // that come in then are queued and run once the command is done
     class Context {
     public:
-        Context(uint8_t* appStart, int boardId,
-                    Conn** conns, int numConns);
+        Context(uint8_t* appStart, uint8_t* stagingStart, size_t slotSize,
+                    int boardId, Conn** conns, int numConns);
 
         void exec(const Msg& cmd, Conn* conn); // Execute a command, returns an error or ok messagek
 
+        // Handles at most one waiting message and returns, resets if that
+        // was requested. Starts looking after the conn it last read
+        // from, so a busy one can't starve the others
+        void poll();
+        // Whether there are queued frames for us (see pump()) left
+        // for poll() to run, even with nothing to read
+        inline bool busy() const { return !_local.empty(); }
+        // Frames that had to be dropped instead of forwarded, with
+        // the conn's queue full (for debugging, never reset)
+        inline uint32_t forwardDrops() const { return _forwardDrops; }
+
         void run(); // Runs the bootloader in this context
+
+        static void task(void* ctx); // poll()s the Context in ctx forever
+        // Every U(S)ART and CAN at once, plus one more (the constructor
+        // stops at a breakpoint if given more)
+        static constexpr int MAX_CONNS = 12;
+        // Writes are buffered and programmed in bursts of up to this
+        // many (aligned) bytes
+        static constexpr size_t WRITE_BURST = 256;
+        // A partial burst is programmed once no word was added to it for
+        // this long (several frame times on uart/can, 1 ms tick)
+        static constexpr uint32_t BURST_IDLE_MS = 2;
+        // WRITE values kept per session for PARITY (a power of 2)
+        static constexpr uint8_t FEC_WINDOW = 32;
+        // Frames waiting for room to be forwarded, per conn
+        static constexpr int OUT_QUEUE = 64;
+        // Frames for us that came in during a flash operation
+        static constexpr int LOCAL_QUEUE = 64;
+    protected:
+        // The parts of poll() around the transport calls,
+        // shared with StaticContext
+        void initLeds();
+        void readFailed();
+        bool received(const Msg& msg); // Returns whether to forward it
+        void process(const Msg& msg, Conn* src, uint32_t frameStart);
+        void idle(); // Nothing to read, programs the bursts gone idle
+
+        // Sends msg (from conn src) on to every other conn, queued if
+        // that one has no room or frames waiting already (dropped and
+        // counted if the queue is full, the host's retransmits deal with that)
+        void forward(const Msg& msg, int src);
+        // Writes out as many of the queued frames as there is room for
+        void drain();
+        // Forwards what has come in without running anything, frames for
+        // us get queued. Only reads while the queue has room, so frames
+        // are never read just to be dropped (they wait in the conn instead)
+        void pump();
+        // Runs the next queued frame for us, false if there is none
+        bool runQueued();
+
+        // (These are on the forwarding path, so in ITCM like it)
+        ITCM_FUNC Buffer<Msg, OUT_QUEUE>& outQueue(int conn) { return _out[conn]; }
+        // Queues msg for conn, counting it if there's no room
+        ITCM_FUNC void queueOut(const Msg& msg, int conn) {
+            if (!_out[conn].push(msg)) _forwardDrops++;
+        }
+        ITCM_FUNC bool localRoom() const { return !_local.full(); }
+        ITCM_FUNC void queueLocal(const Msg& msg, int src) { _local.push(Queued{msg, src}); }
+        // The conn whose frame poll() is running in place (-1 for none),
+        // pump() doesn't read from it until that's released
+        inline void setPeeked(int conn) { _peekedConn = conn; }
+        ITCM_FUNC bool isPeeked(int conn) const { return conn == _peekedConn; }
+
+        // Check if we should handle this message
+        ITCM_FUNC bool handles(const Msg& msg) const {
+            return msg.getID() == _boardId || msg.hasError() ||
+                   msg.getType() == Msg::PING || inGroup(msg);
+        }
+        // Sent to the group we are in (those are handled and forwarded)
+        ITCM_FUNC bool inGroup(const Msg& msg) const {
+            return _group.id && msg.getID() == _group.id;
+        }
+        inline static uint32_t frameCycle() {
+            #ifdef FRAME_TIMING
+            return system::cycle_count();
+            #else
+            return 0;
+            #endif
+        }
     private:
+        // Protocol state, kept per source connection so a host
+        // on one bus can't throw off a transfer on another
+        struct Session {
+            Session() : seqNum(0), slotStart(nullptr), isWriting(false),
+                        position(nullptr), burstStart(nullptr), burstLen(0),
+                        idleLen(0), idleSince(0),
+                        writeError(false), batchLen(0), batchCount(0),
+                        fecHave(0), fecHeld(0) {}
+
+            uint8_t seqNum; // Current sequence number
+            uint8_t* slotStart; // Slot being worked on
+            bool isWriting;
+            uint8_t* position;
+
+            // Writes not programmed yet, any error doing so
+            // is reported by the next command (see sync())
+            uint32_t burst[WRITE_BURST / 4];
+            uint8_t* burstStart;
+            size_t burstLen; // In words
+            // burstLen when idle() last looked, and since when (system::millis())
+            size_t idleLen;
+            uint32_t idleSince;
+            bool writeError;
+
+            // Batch being received
+            Msg batch[Msg::MAX_BATCH];
+            uint8_t batchLen; // 0 if there is none
+            uint8_t batchCount;
+
+            // The last WRITE values by seq num % FEC_WINDOW, to rebuild a
+            // missing one from a PARITY. Those ahead of seqNum wait for it
+            uint32_t fecValues[FEC_WINDOW];
+            uint8_t fecSeqs[FEC_WINDOW];
+            uint32_t fecHave; // Bit set for the slots holding a value
+            uint32_t fecHeld; // Of those, the ones not run yet
+        };
+
+        // A multicast write being received (see Msg::GROUP_JOIN)
+        struct Group {
+            Group() : id(0), session(nullptr), base(nullptr), blocks(0),
+                      block(NO_BLOCK), words(0) {}
+            static constexpr uint32_t NO_BLOCK = 0xFFFFFFFF;
+
+            board_id id; // 0 if we aren't in one
+            Session* session; // The one that joined, writes go through it
+            uint8_t* base;
+            uint32_t blocks;
+
+            uint32_t block; // Being received, NO_BLOCK for none
+            uint64_t words; // Received words of it
+
+            uint32_t missing[Msg::MAX_GROUP_BLOCKS / 32]; // Bit set for missing
+        };
+
+        // Runs a single (non-batch) command and
+        // returns the reply, INVALID for none
+        Msg handle(const Msg& cmd, Session& s);
+        void handleGroup(const Msg& cmd);
+
+        // The image a session writes from its start, hashed as it gets
+        // programmed so that the header's digest can be checked right away
+        struct Hashing {
+            Hashing() : session(nullptr), next(nullptr) {}
+
+            Session* session; // nullptr for none
+            const uint8_t* next; // Hashed up to here
+            image::Sha256 sha;
+        };
+
+        void hashWritten(Session& s, const uint8_t* start, const uint8_t* end);
+        // Checks (and marks) the session's image if it's the one being hashed
+        void finishHash(Session& s);
+
+        // What exec() does once cmd is known to be next in s's sequence
+        void execInSeq(const Msg& cmd, Session& s, Conn* conn);
+        void keepWrite(Session& s, uint8_t seqNum, uint32_t value, bool held);
+        // Rebuilds the WRITE missing from a PARITY's group (as held)
+        void repair(const Msg& parity, Session& s);
+        // Runs the held WRITEs that are next in sequence
+        void runHeld(Session& s, Conn* conn);
+        Msg runBatch(Session& s);
+
+        // Ends the session's write, the flash only gets
+        // locked once no session is writing any more
+        void endWrite(Session& s);
+
+        void bufferWrite(Session& s, uint32_t value);
+        void programBurst(Session& s);
+        // Programs the buffered writes, false (and the write
+        // ended) if that or an earlier burst failed
+        bool sync(Session& s);
+
         // Board config related things
         board_id _boardId;
-        uint8_t* _appStart;
+        uint8_t* _slots[2]; // Indexed by Slot
+        size_t _slotSize;
         Conn** _conns;
         int _numConns;
 
-        // Transmission state
-        uint8_t _seqNum; // Current sequence number
+        // Transmission state, sessions are indexed like _conns
+        Session _sessions[MAX_CONNS];
+
+        struct Queued {
+            Msg msg;
+            int src; // Index of the conn it came in on
+        };
+        Buffer<Msg, OUT_QUEUE> _out[MAX_CONNS]; // Indexed like _conns
+        Buffer<Queued, LOCAL_QUEUE> _local;
+        int _nextConn; // Where poll() starts looking
+        int _peekedConn; // Whose frame is being run in place, -1 for none
+        uint32_t _forwardDrops;
+
+        static void flashIdle(void* ctx); // pump()s the Context in ctx
+        Group _group;
+        Hashing _hash;
+        #ifdef MSG_HISTORY
         Buffer<Msg, 32> _history; // for debugging
+        #endif
+        #ifdef FRAME_TIMING
+        Buffer<uint32_t, 32> _frameCycles; // forward/exec cycles per frame, for debugging
+        #endif
+
+        // Stream to send once the reply is out
+        const uint8_t* _streamStart;
+        size_t _streamLen;
+        uint32_t _baudReq; // Likewise, the rate to switch to
 
         // Command-related stuff
         bool _resetReq;
-        bool _isWriting;
-        uint8_t* _position;
+        bool _debugLeds; // Only once run() has set the pins up
     };
 }
@@ -1,36 +1,39 @@
 #pragma once
 
-#include <cstring>
+#include "System.hpp"
 
 namespace bootloader {
     template<typename T, int cap>
     class Buffer {
     public:
-        Buffer() : _buf(), _idx(0), _len(0) {}
+        // _buf is left default-initialized, the drivers keep their
+        // buffers in static storage and zeroing them here would
+        // just add to the startup time before main()
+        Buffer() : _idx(0), _len(0) {}
 
-        inline bool empty() const {
+        ITCM_FUNC bool empty() const {
             return _len == 0;
         }
 
-        inline bool full() const {
+        ITCM_FUNC bool full() const {
             return _len == cap;
         }
         
-        inline size_t size() const {
+        ITCM_FUNC size_t size() const {
             return _len;
         }
 
-        inline size_t free() const {
+        ITCM_FUNC size_t free() const {
             return cap - _len;
         }
 
         // Returns first element
-        const T& front() const {
+        ITCM_FUNC const T& front() const {
             return _buf[_idx];
         }
 
-        const T& pop() {
-            if (empty()) asm("bkpt 255"); // ERROR!
+        ITCM_FUNC const T& pop() {
+            if (empty()) system::breakpoint(); // ERROR!
             size_t i = _idx;
             _idx = (_idx + 1) % cap;
             _len = _len - 1;
@@ -38,13 +41,32 @@ namespace bootloader {
             return _buf[i];
         }
 
-        bool push(const T& v) {
+        ITCM_FUNC bool push(const T& v) {
             if (full()) return false;
             _buf[(_idx + _len) % cap] = v;
             _len = _len + 1;
             return true;
         }
 
+        // In place access, for filling a slot straight from
+        // a peripheral: reserve() returns the slot push() would
+        // fill (nullptr if full), commit() then adds it
+        ITCM_FUNC T* reserve() {
+            if (full()) return nullptr;
+            return &_buf[(_idx + _len) % cap];
+        }
+        ITCM_FUNC void commit() {
+            _len = _len + 1;
+        }
+
+        // Removes the front element, for when
+        // it was used in place through front()
+        ITCM_FUNC void drop() {
+            if (empty()) system::breakpoint(); // ERROR!
+            _idx = (_idx + 1) % cap;
+            _len = _len - 1;
+        }
+
         // Just dumps into the index
         // to be used for temporary
         // storage style stuff
@@ -61,10 +83,11 @@ namespace bootloader {
             else _idx = (_idx + 1) % cap; // we're overriding the front
         }
 
+        // Like the constructor this leaves _buf alone, nothing
+        // past _len is ever read (and it now holds Msgs too)
         void clear() {
             _idx = 0;
             _len = 0;
-            memset(_buf, 0, sizeof(_buf));
         }
 
     private:
@@ -8,7 +8,9 @@ namespace bootloader {
         class Can : public Conn {
         public:
             Can();
-            Can(const Pin& rx, const Pin& tx, int baud);
+            // Timing is worked out from the APB1 clock (see CanTiming.hpp),
+            // samplePoint is in permille (87.5% is the CANopen default)
+            Can(const Pin& rx, const Pin& tx, int baud, int samplePoint = 875);
             virtual ~Can();
 
             void close() override;
@@ -24,9 +26,19 @@ namespace bootloader {
 
             Conn& operator<<(const Msg& w) override; // Write
             Conn& operator>>(Msg& r) override; // Read
+
+            const Msg* peek() override;
+            void release() override;
         private:
             int _idx;
         };
+
+        // What the interrupt handlers and HAL callbacks in DriverInterrupts.cpp
+        // call (an app can route its own to these instead)
+        void msp_init(CAN_HandleTypeDef* handle);
+        void msp_deinit(CAN_HandleTypeDef* handle);
+        void tx_irq(CAN_TypeDef* instance);
+        void rx_irq(CAN_TypeDef* instance, int fifo);
     }
 }
 
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cinttypes>
+
+namespace bootloader {
+    namespace can {
+        // bxCAN bit timing, in time quanta
+        struct BitTiming {
+            uint32_t prescaler; // 1-1024
+            uint8_t bs1; // 1-16, includes the propagation segment
+            uint8_t bs2; // 1-8
+            uint8_t sjw; // 1-4
+        };
+
+        // Sample point, in permille, the timing gives
+        inline uint32_t sample_point(const BitTiming& t) {
+            return 1000 * (1 + t.bs1) / (1 + t.bs1 + t.bs2);
+        }
+
+        // Finds a timing that hits bitrate exactly from clk (the APB1 clock),
+        // with the sample point (permille) as close to samplePoint as it gets,
+        // preferring more quanta per bit on a tie. False if there is none
+        inline bool bit_timing(uint32_t clk, uint32_t bitrate, uint32_t samplePoint,
+                                BitTiming* t) {
+            if (bitrate == 0) return false;
+            bool found = false;
+            uint32_t bestErr = 0;
+            for (uint32_t tq = 25; tq >= 8; tq--) {
+                if (clk % (bitrate * tq)) continue;
+                uint32_t prescaler = clk / (bitrate * tq);
+                if (prescaler < 1 || prescaler > 1024) continue;
+
+                for (uint32_t bs2 = 1; bs2 <= 8; bs2++) {
+                    uint32_t bs1 = tq - 1 - bs2;
+                    if (bs1 < 1 || bs1 > 16) continue;
+
+                    BitTiming c = {prescaler, (uint8_t) bs1, (uint8_t) bs2,
+                                    (uint8_t) (bs2 < 4 ? bs2 : 4)};
+                    uint32_t sp = sample_point(c);
+                    uint32_t err = sp > samplePoint ? sp - samplePoint : samplePoint - sp;
+                    if (!found || err < bestErr) {
+                        *t = c;
+                        bestErr = err;
+                        found = true;
+                    }
+                }
+            }
+            return found;
+        }
+    }
+}
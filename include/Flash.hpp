@@ -3,12 +3,115 @@
 #include <cstddef>
 #include <cinttypes>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace bootloader {
     namespace flash {
+        // Sector start addresses (single bank), followed by the end of flash
+        static constexpr size_t SECTOR_OFFSETS[] = {
+        /*32kb*/    0x08000000,
+        /*32kb*/    0x08000000 + 1*(0x8000), /* 32kb offset */
+        /*32kb*/    0x08000000 + 2*(0x8000), /* 64kb offset */
+        /*32kb*/    0x08000000 + 3*(0x8000), /* 96kb offset */
+        /*128kb*/   0x08000000 + 1*(0x20000),/* 128kb offset */
+        /*256kb*/   0x08000000 + 1*(0x40000),/* 256kb offset */
+        /*256kb*/   0x08000000 + 2*(0x40000),/* 512kb offset */
+        /*256kb*/   0x08000000 + 3*(0x40000),/* 768kb offset */
+        /*256kb*/   0x08000000 + 4*(0x40000),/* 1024kb offset */
+        /*256kb*/   0x08000000 + 5*(0x40000),/* 1280kb offset */
+        /*256kb*/   0x08000000 + 6*(0x40000),/* 1536kb offset */
+        /*256kb*/   0x08000000 + 7*(0x40000),/* 1792kb offset */
+        /*end*/     0x08000000 + 8*(0x40000) /* 2048kb offset */
+        };
+        static constexpr int NUM_SECTORS = 12;
+
+        // Sector range [startIdx, endIdx) covering length bytes from start,
+        // which has to be on a sector boundary
+        inline bool sector_range(const uint8_t* start, size_t length, int* startIdx, int* endIdx) {
+            *startIdx = -1;
+            *endIdx = -1;
+            for (int i = 0; i < NUM_SECTORS; i++) {
+                if (SECTOR_OFFSETS[i] == (size_t) start) *startIdx = i;
+            }
+            for (int i = *startIdx + 1; *startIdx >= 0 && i <= NUM_SECTORS; i++) {
+                if (SECTOR_OFFSETS[i] >= (size_t) start + length) {
+                    *endIdx = i;
+                    break;
+                }
+            }
+            return *startIdx >= 0 && *endIdx >= 0;
+        }
+
         void unlock();
         void lock();
 
+        // Run between the words being programmed and between the sectors
+        // being erased, i.e. to keep forwarding frames. Never while the
+        // flash is busy, there is just the one bank so the code in it
+        // (and whatever the hook calls) would stall until it's done.
+        // A sector takes 1-2 s though, see set_busy_hook()
+        typedef void (*IdleHook)(void* arg);
+        void set_idle_hook(IdleHook hook, void* arg);
+
+        #if defined(BOOTLOADER_ITCM)
+        // Run over and over while an erase keeps the flash busy. The hook,
+        // everything it calls and the interrupts taken meanwhile all have
+        // to run out of ITCM/RAM (see StaticContext), anything in flash
+        // stalls until the sector is done
+        void set_busy_hook(IdleHook hook, void* arg);
+        #endif
+
+        #if defined(BOOTLOADER_NATIVE)
+        // Maps the emulated flash at the real addresses, kept in
+        // the file at path (if not null) so it survives restarts
+        int map(const char* path);
+        #endif
+
         int write(uint8_t* ptr, uint32_t data);
+        // Programs count words to a word aligned ptr
+        // (32 bit parallelism) and checks them
+        int program(uint8_t* ptr, const uint32_t* words, size_t count);
+        // Skips sectors that are already blank, leaves
+        // the flash locked or unlocked as it found it
         int erase(uint8_t* start, size_t length);
+
+        // Sets bit i of mask if the i-th sector from start (which has to be
+        // on a sector boundary) is blank, for the count sectors covering length
+        int blank_sectors(const uint8_t* start, size_t length, uint32_t* mask, int* count);
+
+        // Whether len bytes from start are all erased (0xFF). ANDs together
+        // 256 bytes at a time, 16 bytes per step (doubleword loads on the
+        // M7, an SSE2 register on a host) before checking
+        inline bool blank(const uint8_t* start, size_t len) {
+            size_t i = 0;
+            for (; i < len && (size_t) (start + i) % 16; i++) {
+                if (start[i] != 0xFF) return false;
+            }
+            #if defined(__SSE2__)
+            const __m128i ones = _mm_set1_epi32(-1);
+            for (; i + 256 <= len; i += 256) {
+                const __m128i* p = (const __m128i*) (start + i);
+                __m128i acc = ones;
+                for (int j = 0; j < 16; j++) acc = _mm_and_si128(acc, _mm_load_si128(p + j));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, ones)) != 0xFFFF) return false;
+            }
+            #else
+            for (; i + 256 <= len; i += 256) {
+                const uint64_t* p = (const uint64_t*) (start + i);
+                uint64_t a = ~0ULL, b = ~0ULL;
+                for (int j = 0; j < 32; j += 2) {
+                    a &= p[j];
+                    b &= p[j + 1];
+                }
+                if ((a & b) != ~0ULL) return false;
+            }
+            #endif
+            for (; i < len; i++) {
+                if (start[i] != 0xFF) return false;
+            }
+            return true;
+        }
     }
 }
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "Bootloader.hpp"
+#include "System.hpp"
+
+namespace bootloader {
+    namespace uart {
+        // The uart framing: a header (0x02 for STATUS/ACK/GROUP_BLOCK/PARITY,
+        // 0x03 for the rest), the 8 byte packet and a little-endian fletcher16 of it.
+        // Bulk frames are 0x04, board id, little-endian u16 length, the
+        // data, then a fletcher16 over everything after the header
+        constexpr size_t FRAME_LEN = 11;
+        constexpr size_t BULK_CHUNK = 1024;
+
+        // A receiver that lost sync skips to the next 0x02 header, so the
+        // host's STATUS, each block of a group write and each PARITY pick
+        // it up. A frame with just a bad checksum (most likely a bit error)
+        // leaves it in sync, so a PARITY can still stand in for it
+        inline uint8_t header(const Msg& m) {
+            return m.getType() == Msg::STATUS || m.getType() == Msg::ACK ||
+                   m.getType() == Msg::GROUP_BLOCK || m.getType() == Msg::PARITY ? 0x02 : 0x03;
+        }
+
+        // prev continues the sum of earlier data
+        ITCM_FUNC uint16_t fletcher16(const uint8_t *data, size_t count, uint16_t prev = 0);
+
+        // Writes the frame for m into buf, returns FRAME_LEN
+        ITCM_FUNC size_t encode(const Msg& m, uint8_t* buf);
+
+        // Parses frames a byte at a time, for the uart driver and the native
+        // tcp conn (which call fail() on their timeouts). After a bad header
+        // or a timeout it skips everything up to the next 0x02 header,
+        // the host sends a STATUS to get things going again
+        class FrameParser {
+        public:
+            enum Result {
+                MORE, // Keep feeding
+                FRAME, // out holds the frame
+                BAD // Bad frame, out has its error set
+            };
+
+            FrameParser() : _len(0), _resync(false) {}
+
+            ITCM_FUNC Result feed(uint8_t byte, Msg* out);
+
+            // Drops a partial frame (i.e. on a timeout),
+            // BAD if there was one
+            Result fail(Msg* out);
+
+            // Drops any partial frame and skips to the next 0x02
+            // header (after a uart error or a baud rate switch)
+            inline void resync() {
+                _len = 0;
+                _resync = true;
+            }
+
+            inline bool partial() const { return _len > 0; }
+        private:
+            uint8_t _buf[FRAME_LEN];
+            size_t _len;
+            bool _resync;
+        };
+    }
+}
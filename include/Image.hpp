@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cinttypes>
+
+namespace bootloader {
+    namespace image {
+        // The app region starts with a header, the app's
+        // vector table follows at HEADER_SIZE (VTOR needs
+        // the 512 byte alignment)
+        constexpr size_t HEADER_SIZE = 0x200;
+
+        constexpr uint32_t MAGIC = 0x474D4942; // "BIMG"
+        constexpr uint32_t VERIFIED = 0x00000000;
+
+        constexpr size_t DIGEST_SIZE = 32; // SHA-256
+
+        // Note: Keep in line with the python client!
+        struct Header {
+            uint32_t magic;
+            uint32_t size; // Bytes of image following the header
+            uint32_t crc; // CRC32 (zlib) of the image
+            uint32_t version;
+            uint32_t buildHash;
+            // Left erased by the client, programmed to VERIFIED
+            // by the bootloader once the digest has checked out
+            // so that we don't have to redo it every boot
+            uint32_t verified;
+            uint8_t digest[DIGEST_SIZE]; // SHA-256 of the image
+        };
+
+        inline const Header* header(const uint8_t* start) {
+            return (const Header*) start;
+        }
+        inline uint8_t* entry(uint8_t* start) {
+            return start + HEADER_SIZE;
+        }
+
+        // CRC32 (zlib flavour), uses the crc unit (bitwise on the host)
+        uint32_t crc32(const uint8_t* data, size_t len);
+
+        // SHA-256 fed a piece at a time, uses the hash unit (in software
+        // on the host). There is only the one unit, so only one can be
+        // going at a time. All pieces but the last have to be whole words
+        class Sha256 {
+        public:
+            void start();
+            void update(const uint8_t* data, size_t len);
+            void finish(uint8_t* digest);
+        private:
+            uint64_t _len;
+            #if defined(BOOTLOADER_NATIVE)
+            void block(const uint8_t* data);
+            uint32_t _state[8];
+            uint8_t _buf[64];
+            #endif
+        };
+
+        void sha256(const uint8_t* data, size_t len, uint8_t* digest);
+
+        // Header is there and the image fits in the region
+        bool present(const uint8_t* start, size_t regionSize);
+
+        // Header is there and the crc has already been checked,
+        // this is cheap enough to do on every boot
+        bool verified(const uint8_t* start, size_t regionSize);
+
+        // Checks the digest of the image and, if good, stores that
+        // in the header. Needs the hal (for flash) and the flash
+        // must not be in use
+        bool verify(uint8_t* start, size_t regionSize);
+
+        // Like verify(), with the image's digest already worked out
+        // (i.e. while it was being written)
+        bool accept(uint8_t* start, size_t regionSize, const uint8_t* digest);
+
+        // Whether the staged image should replace the app: it is
+        // a later version, or the same version but a different
+        // build (only looks at the headers so it's cheap too)
+        bool newer(const uint8_t* staged, const uint8_t* app, size_t regionSize);
+
+        // Copies the image in src over the one in dst, the header
+        // is written last so an interrupted install leaves dst
+        // invalid and src intact to retry from. dst is hashed as
+        // it gets programmed, so it's verified without another pass
+        bool install(uint8_t* dst, const uint8_t* src, size_t regionSize);
+
+        // Clears the magic of a bad image so we don't keep
+        // on checking it
+        void discard(uint8_t* start);
+    }
+}
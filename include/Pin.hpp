@@ -172,6 +172,60 @@ namespace bootloader {
         constexpr Pin PD14('D', 14); 
         constexpr Pin PD15('D', 15); 
 
+        // E pins
+        constexpr Pin PE0('E', 0);
+        constexpr Pin PE1('E', 1);
+        constexpr Pin PE2('E', 2);
+        constexpr Pin PE3('E', 3);
+        constexpr Pin PE4('E', 4);
+        constexpr Pin PE5('E', 5);
+        constexpr Pin PE6('E', 6);
+        constexpr Pin PE7('E', 7);
+        constexpr Pin PE8('E', 8);
+        constexpr Pin PE9('E', 9);
+        constexpr Pin PE10('E', 10);
+        constexpr Pin PE11('E', 11);
+        constexpr Pin PE12('E', 12);
+        constexpr Pin PE13('E', 13);
+        constexpr Pin PE14('E', 14);
+        constexpr Pin PE15('E', 15);
+
+        // F pins
+        constexpr Pin PF0('F', 0);
+        constexpr Pin PF1('F', 1);
+        constexpr Pin PF2('F', 2);
+        constexpr Pin PF3('F', 3);
+        constexpr Pin PF4('F', 4);
+        constexpr Pin PF5('F', 5);
+        constexpr Pin PF6('F', 6);
+        constexpr Pin PF7('F', 7);
+        constexpr Pin PF8('F', 8);
+        constexpr Pin PF9('F', 9);
+        constexpr Pin PF10('F', 10);
+        constexpr Pin PF11('F', 11);
+        constexpr Pin PF12('F', 12);
+        constexpr Pin PF13('F', 13);
+        constexpr Pin PF14('F', 14);
+        constexpr Pin PF15('F', 15);
+
+        // G pins
+        constexpr Pin PG0('G', 0);
+        constexpr Pin PG1('G', 1);
+        constexpr Pin PG2('G', 2);
+        constexpr Pin PG3('G', 3);
+        constexpr Pin PG4('G', 4);
+        constexpr Pin PG5('G', 5);
+        constexpr Pin PG6('G', 6);
+        constexpr Pin PG7('G', 7);
+        constexpr Pin PG8('G', 8);
+        constexpr Pin PG9('G', 9);
+        constexpr Pin PG10('G', 10);
+        constexpr Pin PG11('G', 11);
+        constexpr Pin PG12('G', 12);
+        constexpr Pin PG13('G', 13);
+        constexpr Pin PG14('G', 14);
+        constexpr Pin PG15('G', 15);
+
         // H pins
         constexpr Pin PH0('H', 0);
         constexpr Pin PH1('H', 1);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Bootloader.hpp"
+#include "Pin.hpp"
+
+namespace bootloader {
+    namespace spi {
+        // Slave end of an SPI link (see SpiLink.hpp), for a host MCU
+        // on the same board. Blocks are moved by dma, with the hardware
+        // crc on (8 bit, polynomial 7), so the master has to use that too
+        // and leave the slave a few us between blocks to set up the next
+        class Spi : public Conn {
+        public:
+            Spi();
+            Spi(const Pin& sck, const Pin& miso, const Pin& mosi, const Pin& nss);
+            virtual ~Spi();
+
+            bool isOpen() const override;
+            void close() override;
+
+            bool hasData() const override;
+
+            size_t getReadWindow() const override;
+            size_t getWriteWindow() const override;
+
+            void flush() override;
+
+            Conn& operator<<(const Msg& w) override; // Write
+            Conn& operator>>(Msg& r) override; // Read
+
+            const Msg* peek() override;
+            void release() override;
+        private:
+            int _idx;
+        };
+
+        // What the interrupt handlers and HAL callbacks in DriverInterrupts.cpp
+        // call (an app can route its own to these instead), n counts
+        // SPI1, SPI3, SPI4, SPI5 from 0
+        void msp_init(SPI_HandleTypeDef* handle);
+        void msp_deinit(SPI_HandleTypeDef* handle);
+        void done(SPI_HandleTypeDef* handle);
+        void error(SPI_HandleTypeDef* handle);
+        void irq(int n);
+        void rx_dma_irq(int n);
+        void tx_dma_irq(int n);
+    }
+}
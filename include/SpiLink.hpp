@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Bootloader.hpp"
+#include "Buffer.hpp"
+
+namespace bootloader {
+    namespace spi {
+        // Both ends swap fixed size blocks (full duplex, the master
+        // clocks every one of them). A block is a header of the magic,
+        // the number of packets that follow and the sender's free read
+        // slots (its credit to the other end), then the packets, padded
+        // out to BLOCK_SIZE. A master with nothing to send still clocks
+        // empty blocks to collect replies
+        struct BlockHeader {
+            uint8_t magic;
+            uint8_t count;
+            uint8_t credit;
+            uint8_t reserved;
+        };
+        constexpr uint8_t BLOCK_MAGIC = 0xB5;
+        constexpr size_t BLOCK_PACKETS = 32;
+        constexpr size_t BLOCK_SIZE = sizeof(BlockHeader) + 8 * BLOCK_PACKETS;
+
+        // The framing and flow control for one end, without the
+        // hardware: fill() the next block to send, take() the one
+        // that came back. Packets are only sent while the other end
+        // has credit for them so neither end drops any for lack of room
+        class Link {
+        public:
+            Link();
+
+            // Fills the block to send next with as many
+            // queued packets as the other end can take
+            void fill(uint8_t* block);
+            // Takes in the block that was received alongside
+            // the last filled one, false if it was bad
+            bool take(const uint8_t* block);
+            // The block got lost (bus error), assume no credit
+            // until the next good one
+            void dropped();
+
+            inline bool hasData() const { return !_rx.empty(); }
+            inline const Msg& front() const { return _rx.front(); }
+            inline void drop() { _rx.drop(); }
+            inline Msg pop() { return _rx.pop(); }
+
+            // False if the queue is full
+            inline bool push(const Msg& m) { return _tx.push(m); }
+            inline bool sent() const { return _tx.empty(); }
+
+            inline size_t readWindow() const { return _rx.free(); }
+            inline size_t writeWindow() const { return _tx.free(); }
+        private:
+            Buffer<Msg, 256> _rx;
+            Buffer<Msg, 256> _tx;
+            size_t _credit; // Packets the other end has room for
+            size_t _inFlight; // Packets in the last filled block
+        };
+    }
+}
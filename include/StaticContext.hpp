@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+
+#include "Bootloader.hpp"
+#include "Flash.hpp"
+
+namespace bootloader {
+    // A Context with its transports fixed at compile time: poll() calls
+    // straight into each transport type instead of going through Conn,
+    // and the loops over them are unrolled. Only the replies from exec()
+    // still go through Conn. Build with FRAME_TIMING to compare the
+    // per frame cycles against the plain Context. The flash idle hook
+    // forwards through the transport types as well. Built with
+    // BOOTLOADER_ITCM that's all in ITCM, so it's the busy hook too and
+    // keeps forwarding while a sector erases (for uart and can, the spi
+    // interrupts go through the hal)
+    template<typename... Ts>
+    class StaticContext : public Context {
+    public:
+        static_assert(sizeof...(Ts) > 0 && sizeof...(Ts) <= MAX_CONNS,
+                      "StaticContext takes 1 to MAX_CONNS transports");
+
+        StaticContext(uint8_t* appStart, uint8_t* stagingStart, size_t slotSize,
+                        int boardId, Ts&... conns) :
+                        Context(appStart, stagingStart, slotSize, boardId,
+                                _conns, sizeof...(Ts)),
+                        _transports(conns...),
+                        _conns{&conns...},
+                        _next(0) {
+            flash::set_idle_hook(&StaticContext::flashIdle, this);
+            #ifdef BOOTLOADER_ITCM
+            flash::set_busy_hook(&StaticContext::flashIdle, this);
+            #endif
+        }
+
+        inline void poll() {
+            drainFrom<0>();
+            // What came in while the last command ran goes first
+            if (runQueued()) return;
+            // From the transport after the last one read from
+            if (!pollFrom<0>(_next) && !pollFrom<0>(0)) idle();
+        }
+
+        void run() {
+            initLeds();
+            // poll() resets for us
+            while (true) poll();
+        }
+
+        static void task(void* ctx) {
+            StaticContext* c = (StaticContext*) ctx;
+            while (true) c->poll();
+        }
+
+    private:
+        template<size_t I>
+        using Transport = typename std::tuple_element<I, std::tuple<Ts...>>::type;
+
+        // Whether a frame was read (from transport first on)
+        template<size_t I>
+        inline typename std::enable_if<(I == sizeof...(Ts)), bool>::type pollFrom(size_t first) {
+            return false;
+        }
+
+        template<size_t I>
+        inline typename std::enable_if<(I < sizeof...(Ts)), bool>::type pollFrom(size_t first) {
+            using T = Transport<I>;
+            T& c = std::get<I>(_transports);
+            if (I >= first && c.T::hasData()) {
+                uint32_t frameStart = frameCycle();
+                Msg read;
+                const Msg* msg = c.T::peek(); // In place if T supports it
+                bool peeked = msg != nullptr;
+                if (!peeked) {
+                    c.T::operator>>(read);
+                    msg = &read;
+                }
+                if (!msg->hasError()) {
+                    if (received(*msg)) forwardFrom<I, 0>(*msg);
+                    _next = I + 1;
+                    // pumpFrom() leaves c alone while msg is in it
+                    if (peeked) setPeeked(I);
+                    process(*msg, &c, frameStart);
+                    if (peeked) {
+                        setPeeked(-1);
+                        c.T::release();
+                    }
+                    return true;
+                }
+                if (peeked) c.T::release();
+                readFailed();
+            }
+            return pollFrom<I + 1>(first);
+        }
+
+        // Like Context::forward()
+        template<size_t Src, size_t I>
+        ITCM_FUNC typename std::enable_if<(I == sizeof...(Ts))>::type forwardFrom(const Msg& msg) {}
+
+        template<size_t Src, size_t I>
+        ITCM_FUNC typename std::enable_if<(I < sizeof...(Ts))>::type forwardFrom(const Msg& msg) {
+            using T = Transport<I>;
+            if (I != Src) {
+                T& c = std::get<I>(_transports);
+                Buffer<Msg, OUT_QUEUE>& q = outQueue(I);
+                if (q.empty() && c.T::getWriteWindow()) {
+                    c.T::operator<<(msg);
+                } else {
+                    queueOut(msg, I);
+                }
+            }
+            forwardFrom<Src, I + 1>(msg);
+        }
+
+        // Like Context::drain()
+        template<size_t I>
+        ITCM_FUNC typename std::enable_if<(I == sizeof...(Ts))>::type drainFrom() {}
+
+        template<size_t I>
+        ITCM_FUNC typename std::enable_if<(I < sizeof...(Ts))>::type drainFrom() {
+            using T = Transport<I>;
+            T& c = std::get<I>(_transports);
+            Buffer<Msg, OUT_QUEUE>& q = outQueue(I);
+            while (!q.empty() && c.T::getWriteWindow()) {
+                c.T::operator<<(q.front());
+                q.drop();
+            }
+            drainFrom<I + 1>();
+        }
+
+        // Like Context::pump()
+        template<size_t I>
+        ITCM_FUNC typename std::enable_if<(I == sizeof...(Ts))>::type pumpFrom() {}
+
+        template<size_t I>
+        ITCM_FUNC typename std::enable_if<(I < sizeof...(Ts))>::type pumpFrom() {
+            using T = Transport<I>;
+            T& c = std::get<I>(_transports);
+            if (!localRoom()) return;
+            if (!isPeeked(I) && c.T::hasData()) {
+                Msg read;
+                const Msg* msg = c.T::peek();
+                bool peeked = msg != nullptr;
+                if (!peeked) {
+                    c.T::operator>>(read);
+                    msg = &read;
+                }
+                if (msg->hasError()) {
+                    readFailed();
+                } else {
+                    if (received(*msg)) forwardFrom<I, 0>(*msg);
+                    if (handles(*msg)) queueLocal(*msg, I);
+                }
+                if (peeked) c.T::release();
+            }
+            pumpFrom<I + 1>();
+        }
+
+        ITCM_FUNC static void flashIdle(void* ctx) {
+            StaticContext* c = (StaticContext*) ctx;
+            c->drainFrom<0>();
+            c->pumpFrom<0>();
+        }
+
+        std::tuple<Ts&...> _transports;
+        Conn* _conns[sizeof...(Ts)]; // For exec() and reset
+        size_t _next; // Where poll() starts looking
+    };
+}
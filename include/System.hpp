@@ -1,3 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <cinttypes>
+
+// Hot functions (isrs, buffer ops, frame parsing) are placed
+// in ITCM RAM when built with BOOTLOADER_ITCM, full_init copies
+// them there so they must not be called before that
+#ifdef BOOTLOADER_ITCM
+#define ITCM_FUNC __attribute__((section(".itcm_text")))
+#else
+#define ITCM_FUNC
+#endif
+
 namespace bootloader {
     namespace system {
         // Brings up hal, rtc backup registers
@@ -7,6 +21,36 @@ namespace bootloader {
         void full_init();
         void deinit();
         void run(void* app);
+        // Jumps straight into the app vector table
+        // without deinitializing anything, only safe
+        // if nothing has been brought up yet
+        void jump(void* app);
+
+        // Raw rtc backup register access, works
+        // before any of the init functions are called
+        uint32_t read_backup(int reg);
+        void write_backup(int reg, uint32_t val);
+
+        // D-cache maintenance, no-ops unless built with BOOTLOADER_DCACHE.
+        // Clean before a DMA reads from memory the cpu wrote, invalidate
+        // before the cpu reads memory written behind its back (DMA, flash)
+        void dcache_clean(const void* addr, size_t len);
+        void dcache_invalidate(const void* addr, size_t len);
+
+        // Milliseconds since startup (the hal tick)
+        uint32_t millis();
+
+        // DWT cycle counter (for timing measurements)
+        void start_cycle_counter();
+        uint32_t cycle_count();
+
+        // Resets the chip (exits on the host)
+        void reset();
+
+        #if defined(BOOTLOADER_NATIVE)
+        inline void breakpoint() { __builtin_trap(); }
+        #else
         inline void breakpoint() { asm("bkpt 255"); }
+        #endif
     }
 }
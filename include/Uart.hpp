@@ -23,9 +23,23 @@ namespace bootloader {
 
             Conn& operator<<(const Msg& w) override; // Write
             Conn& operator>>(Msg& r) override; // Read
+
+            // As bulk frames, dma'd straight from data
+            void writeBulk(board_id id, const uint8_t* data, size_t len) override;
+
+            // Within 2%, with 8x oversampling above a sixteenth of the clock
+            bool baudValid(uint32_t baud) const override;
+            void setBaud(uint32_t baud) override;
         private:
             int _idx;
         };
+
+        // What the interrupt handlers and HAL callbacks in DriverInterrupts.cpp
+        // call (an app can route its own to these instead), n counts
+        // USART1, USART2, USART3, UART4, UART5, USART6, UART7, UART8 from 0
+        void msp_init(UART_HandleTypeDef* handle);
+        void msp_deinit(UART_HandleTypeDef* handle);
+        void irq(int n);
     }
 }
 
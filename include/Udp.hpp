@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Bootloader.hpp"
+#include "Buffer.hpp"
+
+#if !defined(BOOTLOADER_NATIVE)
+struct udp_pcb;
+struct pbuf;
+struct ip4_addr;
+#endif
+
+namespace bootloader {
+    namespace udp {
+        // Each datagram starts with its kind, a FRAMES datagram holds up
+        // to MAX_FRAMES 8 byte packets back to back, a BULK one the board
+        // id, a little-endian u16 length and up to MAX_BULK bytes of data.
+        // UDP does the checksumming for us
+        enum Kind : uint8_t {
+            FRAMES = 0x03,
+            BULK = 0x04
+        };
+        constexpr size_t MAX_FRAMES = 64;
+        constexpr size_t MAX_BULK = 1024;
+        constexpr size_t MAX_DATAGRAM = 4 + MAX_BULK; // Within an ethernet mtu
+
+        constexpr uint16_t DEFAULT_PORT = 6969;
+
+        // Replies go to whoever sent the last datagram. Frames written
+        // are held back and go out together once everything received
+        // has been read (or the datagram is full), so a window of
+        // frames from the client gets its replies in one datagram.
+        //
+        // On the host this is a non-blocking socket. On the board it
+        // uses the lwIP raw api, the board has to have brought up the
+        // ethernet netif and keep feeding it (NO_SYS, from the same loop)
+        class Udp : public Conn {
+        public:
+            Udp(uint16_t port = DEFAULT_PORT);
+            ~Udp();
+
+            bool isOpen() const override;
+            void close() override;
+
+            bool hasData() const override;
+
+            size_t getReadWindow() const override;
+            size_t getWriteWindow() const override;
+
+            void flush() override;
+
+            Conn& operator>>(Msg &r) override;
+            Conn& operator<<(const Msg &w) override;
+
+            const Msg* peek() override;
+            void release() override;
+
+            void writeBulk(board_id id, const uint8_t* data, size_t len) override;
+        private:
+            // Queues the frames of a received datagram
+            void parse(const uint8_t* data, size_t len) const;
+            void receive() const;
+            void send(const uint8_t* data, size_t len) const;
+
+            #if defined(BOOTLOADER_NATIVE)
+            int _sock;
+            #else
+            // lwIP receive callback (ipv4 only, like the cube lwipopts)
+            static void recv(void* arg, udp_pcb* pcb, pbuf* p,
+                                const ip4_addr* addr, uint16_t port);
+            udp_pcb* _pcb;
+            #endif
+            // Last sender, as the backend stores it
+            mutable uint8_t _peer[16];
+            mutable bool _hasPeer;
+
+            mutable Buffer<Msg, 256> _rxBuf;
+            mutable uint8_t _tx[MAX_DATAGRAM];
+            mutable size_t _txLen; // 0 if nothing is pending
+        };
+    }
+}
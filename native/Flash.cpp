@@ -0,0 +1,107 @@
+#include "Flash.hpp"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+// Flash emulated in a mapping at the real addresses so that
+// the (32 bit) positions the protocol passes around just work
+static const size_t FLASH_START = bootloader::flash::SECTOR_OFFSETS[0];
+static const size_t FLASH_SIZE = bootloader::flash::SECTOR_OFFSETS[bootloader::flash::NUM_SECTORS]
+                                    - FLASH_START;
+
+static bool s_locked = true;
+
+static bootloader::flash::IdleHook s_idleHook = nullptr;
+static void* s_idleArg = nullptr;
+
+namespace bootloader { namespace flash {
+    int map(const char* path) {
+        int fd = -1;
+        bool fresh = true; // Starts out erased
+        int flags = MAP_FIXED_NOREPLACE | MAP_PRIVATE | MAP_ANONYMOUS;
+        if (path) {
+            fd = open(path, O_RDWR | O_CREAT, 0644);
+            if (fd < 0) return -1;
+            fresh = lseek(fd, 0, SEEK_END) == 0;
+            if (ftruncate(fd, FLASH_SIZE)) {
+                ::close(fd);
+                return -1;
+            }
+            flags = MAP_FIXED_NOREPLACE | MAP_SHARED;
+        }
+        void* mem = mmap((void*) FLASH_START, FLASH_SIZE, PROT_READ | PROT_WRITE, flags, fd, 0);
+        if (fd >= 0) ::close(fd);
+        if (mem != (void*) FLASH_START) return -1;
+        if (fresh) memset(mem, 0xFF, FLASH_SIZE);
+        return 0;
+    }
+
+    void unlock() {
+        s_locked = false;
+    }
+    void lock() {
+        s_locked = true;
+    }
+
+    // Nothing takes any time here, the hook just
+    // runs once per sector/program like it would at least
+    void set_idle_hook(IdleHook hook, void* arg) {
+        s_idleHook = hook;
+        s_idleArg = arg;
+    }
+
+    static void idle() {
+        if (s_idleHook) s_idleHook(s_idleArg);
+    }
+
+    // Programming can only clear bits, like the real thing
+    static int program_bytes(uint8_t* ptr, const uint8_t* data, size_t len) {
+        if (s_locked || (size_t) ptr < FLASH_START ||
+                (size_t) ptr + len > FLASH_START + FLASH_SIZE) return -1;
+        for (size_t i = 0; i < len; i++) ptr[i] &= data[i];
+        return memcmp(ptr, data, len) ? -1 : 0;
+    }
+
+    int write(uint8_t* ptr, uint32_t data) {
+        return program_bytes(ptr, (const uint8_t*) &data, 4);
+    }
+
+    int program(uint8_t* ptr, const uint32_t* words, size_t count) {
+        if ((size_t) ptr % 4) return -1;
+        idle();
+        return program_bytes(ptr, (const uint8_t*) words, 4 * count);
+    }
+
+    static bool sector_blank(int idx) {
+        return blank((const uint8_t*) SECTOR_OFFSETS[idx],
+                     SECTOR_OFFSETS[idx + 1] - SECTOR_OFFSETS[idx]);
+    }
+
+    int blank_sectors(const uint8_t* start, size_t length, uint32_t* mask, int* count) {
+        int startIdx, endIdx;
+        *mask = 0;
+        *count = 0;
+        if (length == 0) return 0;
+        if (!sector_range(start, length, &startIdx, &endIdx)) return 1;
+        *count = endIdx - startIdx;
+        for (int i = startIdx; i < endIdx; i++) {
+            if (sector_blank(i)) *mask |= 1U << (i - startIdx);
+        }
+        return 0;
+    }
+
+    int erase(uint8_t* start, size_t length) {
+        if (length == 0) return 0;
+
+        int startIdx, endIdx;
+        if (!sector_range(start, length, &startIdx, &endIdx)) return 1;
+        for (int i = startIdx; i < endIdx; i++) {
+            if (sector_blank(i)) continue;
+            idle();
+            memset((void*) SECTOR_OFFSETS[i], 0xFF, SECTOR_OFFSETS[i + 1] - SECTOR_OFFSETS[i]);
+        }
+        return 0;
+    }
+}}
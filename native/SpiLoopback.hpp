@@ -0,0 +1,57 @@
+#pragma once
+
+#include "SpiLink.hpp"
+
+namespace bootloader {
+    namespace spi {
+        // Stands in for the Spi slave on the host: the Context reads
+        // and writes the slave Link, exchange() is one block clocked
+        // by the master (which gets driven through master())
+        class Loopback : public Conn {
+        public:
+            bool isOpen() const override { return true; }
+            void close() override {}
+
+            bool hasData() const override { return _slave.hasData(); }
+
+            size_t getReadWindow() const override { return _slave.readWindow(); }
+            size_t getWriteWindow() const override { return _slave.writeWindow(); }
+
+            void flush() override {
+                while (!_slave.sent()) exchange();
+            }
+
+            Conn& operator<<(const Msg& w) override {
+                while (!_slave.push(w)) exchange();
+                return *this;
+            }
+            Conn& operator>>(Msg& r) override {
+                while (!_slave.hasData()) exchange();
+                r = _slave.pop();
+                return *this;
+            }
+
+            const Msg* peek() override { return hasData() ? &_slave.front() : nullptr; }
+            void release() override { _slave.drop(); }
+
+            Link& master() { return _master; }
+            // Nothing left to send either way
+            bool idle() const { return _master.sent() && _slave.sent(); }
+
+            // Swaps a block each way, returns the blocks so far
+            size_t exchange() {
+                uint8_t toSlave[BLOCK_SIZE];
+                uint8_t toMaster[BLOCK_SIZE];
+                _master.fill(toSlave);
+                _slave.fill(toMaster);
+                _slave.take(toSlave);
+                _master.take(toMaster);
+                return ++_blocks;
+            }
+        private:
+            Link _master;
+            Link _slave;
+            size_t _blocks = 0;
+        };
+    }
+}
@@ -0,0 +1,51 @@
+#include "System.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// The backup registers only need to
+// survive for as long as the process
+static uint32_t s_backup[32];
+
+namespace bootloader { namespace system {
+    void partial_init() {}
+    void full_init() {}
+    void deinit() {}
+    void run(void* app) {
+        jump(app);
+    }
+    void jump(void* app) {
+        // Nothing to run the app on
+        printf("jump to app at %p\n", app);
+        exit(0);
+    }
+    void reset() {
+        printf("reset\n");
+        exit(0);
+    }
+
+    uint32_t read_backup(int reg) {
+        return s_backup[reg];
+    }
+    void write_backup(int reg, uint32_t val) {
+        s_backup[reg] = val;
+    }
+
+    void dcache_clean(const void* addr, size_t len) {}
+    void dcache_invalidate(const void* addr, size_t len) {}
+
+    uint32_t millis() {
+        timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (uint32_t) (t.tv_sec * 1000ULL + t.tv_nsec / 1000000);
+    }
+
+    // Nanoseconds rather than cycles
+    void start_cycle_counter() {}
+    uint32_t cycle_count() {
+        timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (uint32_t) (t.tv_sec * 1000000000ULL + t.tv_nsec);
+    }
+}}
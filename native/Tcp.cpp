@@ -0,0 +1,154 @@
+#include "Tcp.hpp"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+// Like the uart driver, a frame that stalls this long is dropped
+#define BYTE_TIMEOUT_NS 10000000ULL
+
+static uint64_t now() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+namespace bootloader {
+    namespace tcp {
+        Tcp::Tcp(uint16_t port) : _listen(-1), _sock(-1), _lastByte(0) {
+            int sock = socket(AF_INET, SOCK_STREAM, 0);
+            if (sock < 0) return;
+            int one = 1;
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr.sin_port = htons(port);
+            if (bind(sock, (sockaddr*) &addr, sizeof(addr)) || listen(sock, 1) ||
+                    fcntl(sock, F_SETFL, O_NONBLOCK)) {
+                ::close(sock);
+                return;
+            }
+            _listen = sock;
+        }
+
+        Tcp::~Tcp() {
+            close();
+        }
+
+        bool
+        Tcp::isOpen() const {
+            return _listen >= 0;
+        }
+
+        void
+        Tcp::close() {
+            if (_sock >= 0) ::close(_sock);
+            if (_listen >= 0) ::close(_listen);
+            _sock = -1;
+            _listen = -1;
+        }
+
+        void
+        Tcp::receive() const {
+            if (_sock < 0) {
+                if (_listen < 0) return;
+                _sock = accept(_listen, nullptr, nullptr);
+                if (_sock < 0) return;
+                int one = 1;
+                setsockopt(_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                fcntl(_sock, F_SETFL, O_NONBLOCK);
+                _parser = uart::FrameParser();
+            }
+
+            uint8_t buf[512];
+            // Leave the rest in the socket if we can't take it
+            while (_rxBuf.free() >= sizeof(buf) / uart::FRAME_LEN + 1) {
+                ssize_t n = recv(_sock, buf, sizeof(buf), 0);
+                if (n == 0) { // Client went away
+                    ::close(_sock);
+                    _sock = -1;
+                    return;
+                }
+                if (n < 0) break;
+                for (ssize_t i = 0; i < n; i++) {
+                    Msg* m = _rxBuf.reserve();
+                    if (_parser.feed(buf[i], m) != uart::FrameParser::MORE) _rxBuf.commit();
+                }
+                _lastByte = now();
+            }
+            if (_parser.partial() && now() - _lastByte > BYTE_TIMEOUT_NS) {
+                Msg* m = _rxBuf.reserve();
+                if (m && _parser.fail(m) == uart::FrameParser::BAD) _rxBuf.commit();
+            }
+        }
+
+        bool
+        Tcp::hasData() const {
+            receive();
+            return !_rxBuf.empty();
+        }
+
+        size_t
+        Tcp::getReadWindow() const {
+            return _rxBuf.free();
+        }
+
+        size_t
+        Tcp::getWriteWindow() const {
+            return 256;
+        }
+
+        void
+        Tcp::flush() {}
+
+        Conn&
+        Tcp::operator>>(Msg &r) {
+            while (!hasData()) {}
+            r = _rxBuf.pop();
+            return *this;
+        }
+
+        void
+        Tcp::send(const uint8_t* data, size_t len) {
+            while (_sock >= 0 && len > 0) {
+                ssize_t n = ::send(_sock, data, len, MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (errno == EAGAIN) continue;
+                    return;
+                }
+                data += n;
+                len -= n;
+            }
+        }
+
+        Conn&
+        Tcp::operator<<(const Msg &w) {
+            uint8_t buf[uart::FRAME_LEN];
+            send(buf, uart::encode(w, buf));
+            return *this;
+        }
+
+        void
+        Tcp::writeBulk(board_id id, const uint8_t* data, size_t len) {
+            while (len > 0) {
+                size_t n = len < uart::BULK_CHUNK ? len : uart::BULK_CHUNK;
+                uint8_t head[4] = {0x04, id, (uint8_t) (n & 0xFF), (uint8_t) (n >> 8)};
+                uint16_t checksum = uart::fletcher16(data, n, uart::fletcher16(&head[1], 3));
+                uint8_t tail[2] = {(uint8_t) (checksum & 0xFF), (uint8_t) (checksum >> 8)};
+                send(head, sizeof(head));
+                send(data, n);
+                send(tail, sizeof(tail));
+                data += n;
+                len -= n;
+            }
+        }
+    }
+}
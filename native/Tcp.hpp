@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Bootloader.hpp"
+#include "Buffer.hpp"
+#include "Frame.hpp"
+
+namespace bootloader {
+    namespace tcp {
+        // Stands in for the uart on the host: the same framing over a
+        // tcp byte stream (one client at a time), so a link simulator
+        // can sit in between and mangle the bytes
+        class Tcp : public Conn {
+        public:
+            Tcp(uint16_t port);
+            ~Tcp();
+
+            bool isOpen() const override;
+            void close() override;
+
+            bool hasData() const override;
+
+            size_t getReadWindow() const override;
+            size_t getWriteWindow() const override;
+
+            void flush() override;
+
+            Conn& operator>>(Msg &r) override;
+            Conn& operator<<(const Msg &w) override;
+
+            void writeBulk(board_id id, const uint8_t* data, size_t len) override;
+        private:
+            // Takes in whatever has arrived
+            void receive() const;
+            void send(const uint8_t* data, size_t len);
+
+            int _listen;
+            mutable int _sock; // The client, -1 if there is none
+            mutable uart::FrameParser _parser;
+            mutable Buffer<Msg, 256> _rxBuf;
+            mutable uint64_t _lastByte; // ns, for the inter-byte timeout
+        };
+    }
+}
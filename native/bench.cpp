@@ -0,0 +1,250 @@
+#include "Bootloader.hpp"
+#include "Buffer.hpp"
+#include "Flash.hpp"
+#include "Frame.hpp"
+#include "Image.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using namespace bootloader;
+
+#define APP_START 0x08080000
+#define STAGING_START 0x08140000
+#define SLOT_SIZE (STAGING_START - APP_START)
+
+#define BOARD_ID 1
+
+// Times the primitives every frame goes through, to catch a throughput
+// regression before it gets onto a board. Host numbers, so only good for
+// comparing against an earlier run on the same machine:
+//
+//   bench [name filter] [ms per benchmark]
+static const char* s_filter = nullptr;
+static double s_minTime = 0.1;
+
+// Keeps the compiler from optimizing away what is being timed
+template<typename T>
+static inline void keep(const T& v) {
+    asm volatile("" : : "g"(&v) : "memory");
+}
+
+static double now() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Runs f(n) (which does n ops of bytes each) with n doubling until
+// it takes long enough, then prints the time and rate per op
+template<typename F>
+static void bench(const char* name, size_t bytes, F f) {
+    if (s_filter && !strstr(name, s_filter)) return;
+    size_t n = 64;
+    double elapsed;
+    while (true) {
+        double start = now();
+        f(n);
+        elapsed = now() - start;
+        if (elapsed >= s_minTime) break;
+        n *= 2;
+    }
+    double ns = elapsed * 1e9 / n;
+    printf("%-24s %10.2f ns/op %10.1f MB/s\n", name, ns, bytes * n / elapsed / 1e6);
+}
+
+// Takes the replies, counting them
+class Sink : public Conn {
+public:
+    bool isOpen() const override { return true; }
+    void close() override {}
+    bool hasData() const override { return false; }
+    size_t getReadWindow() const override { return 256; }
+    size_t getWriteWindow() const override { return 256; }
+    void flush() override {}
+    Conn& operator>>(Msg &r) override { return *this; }
+    Conn& operator<<(const Msg &w) override { replies++; keep(w); return *this; }
+    void writeBulk(board_id id, const uint8_t* data, size_t len) override { keep(data); }
+
+    size_t replies = 0;
+};
+
+static Msg command(Msg::Type type, uint8_t seq, uint32_t value) {
+    Msg m;
+    m.setID(BOARD_ID);
+    m.setType(type);
+    m.setSeqNum(seq);
+    m.setLength(4);
+    m.setValue(value);
+    return m;
+}
+
+static void buffers() {
+    static Buffer<Msg, 256> msgs;
+    static Buffer<uint32_t, 256> words;
+    Msg m = command(Msg::WRITE, 0, 0x12345678);
+
+    bench("buffer push/pop msg", sizeof(Msg::Packet), [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            msgs.push(m);
+            keep(msgs.pop());
+        }
+    });
+    bench("buffer reserve/drop msg", sizeof(Msg::Packet), [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            *msgs.reserve() = m;
+            msgs.commit();
+            keep(msgs.front());
+            msgs.drop();
+        }
+    });
+    bench("buffer put msg", sizeof(Msg::Packet), [&](size_t n) {
+        for (size_t i = 0; i < n; i++) msgs.put(m);
+        keep(msgs.front());
+        msgs.clear();
+    });
+    bench("buffer push/pop u32", 4, [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            words.push(i);
+            keep(words.pop());
+        }
+    });
+}
+
+static void checksums() {
+    static uint8_t data[uart::BULK_CHUNK];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = rand();
+
+    bench("fletcher16 8", 8, [&](size_t n) {
+        for (size_t i = 0; i < n; i++) keep(uart::fletcher16(data, 8));
+    });
+    bench("fletcher16 1024", sizeof(data), [&](size_t n) {
+        for (size_t i = 0; i < n; i++) keep(uart::fletcher16(data, sizeof(data)));
+    });
+    bench("sha256 1024", sizeof(data), [&](size_t n) {
+        image::Sha256 sha;
+        uint8_t digest[image::DIGEST_SIZE];
+        sha.start();
+        for (size_t i = 0; i < n; i++) sha.update(data, sizeof(data));
+        sha.finish(digest);
+        keep(digest[0]);
+    });
+}
+
+static void frames() {
+    Msg m = command(Msg::WRITE, 0, 0x12345678);
+    Msg::Packet p = m.pack();
+
+    bench("msg pack", sizeof(p), [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            m.setSeqNum(i);
+            keep(m.pack());
+        }
+    });
+    bench("msg unpack", sizeof(p), [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            p.fields.seqNum = i;
+            m.unpack(p);
+            keep(m);
+        }
+    });
+
+    // A stream of frames, every 16th with the 0x02 header
+    const size_t count = 64;
+    static uint8_t stream[count * uart::FRAME_LEN];
+    for (size_t i = 0; i < count; i++) {
+        uart::encode(command(i % 16 ? Msg::WRITE : Msg::STATUS, i, i), &stream[i * uart::FRAME_LEN]);
+    }
+
+    // What Uart::operator<< and operator>> run per frame (less the rings)
+    bench("frame encode", uart::FRAME_LEN, [&](size_t n) {
+        uint8_t buf[uart::FRAME_LEN];
+        for (size_t i = 0; i < n; i++) {
+            m.setSeqNum(i);
+            keep(uart::encode(m, buf));
+            keep(buf);
+        }
+    });
+    bench("frame parse", uart::FRAME_LEN, [&](size_t n) {
+        uart::FrameParser parser;
+        Msg out;
+        size_t frames = 0;
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t* f = &stream[(i % count) * uart::FRAME_LEN];
+            for (size_t j = 0; j < uart::FRAME_LEN; j++) {
+                if (parser.feed(f[j], &out) == uart::FrameParser::FRAME) frames++;
+            }
+        }
+        keep(frames);
+    });
+}
+
+// Dispatch through exec(), per message type, with the seq nums in order
+static void dispatch() {
+    static Sink sink;
+    static Conn* conns[] = {&sink};
+    static Context ctx((uint8_t*) APP_START, (uint8_t*) STAGING_START, SLOT_SIZE,
+                       BOARD_ID, conns, 1);
+    static uint8_t seq = 0;
+
+    struct {
+        const char* name;
+        Msg::Type type;
+        uint32_t value;
+        bool inSeq; // Whether it takes up a seq num
+    } cmds[] = {
+        {"exec STATUS", Msg::STATUS, 0, false},
+        {"exec GET_MODE", Msg::GET_MODE, 0, true},
+        {"exec POSITION", Msg::POSITION, 0, true},
+        {"exec MOVE", Msg::MOVE, STAGING_START, true},
+        {"exec READ", Msg::READ, 0, true},
+        {"exec IMAGE_INFO", Msg::IMAGE_INFO, 0, true},
+        // Dropped at the seq num check
+        {"exec out of seq", Msg::POSITION, 0, false},
+    };
+    for (auto& c : cmds) {
+        bench(c.name, sizeof(Msg::Packet), [&](size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                // Keep READ inside the slot
+                if (c.type == Msg::READ && i % 1024 == 0) {
+                    ctx.exec(command(Msg::MOVE, seq++, STAGING_START), &sink);
+                }
+                ctx.exec(command(c.type, c.inSeq || c.type == Msg::STATUS ? seq : seq + 1,
+                                 c.value), &sink);
+                if (c.inSeq) seq++;
+            }
+        });
+    }
+
+    // Buffered into bursts and programmed into the emulated flash,
+    // moving back to the start before running off the end of the slot
+    ctx.exec(command(Msg::UNLOCK_FLASH, seq++, 0), &sink);
+    bench("exec WRITE", 4, [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (i % (SLOT_SIZE / 4) == 0) {
+                ctx.exec(command(Msg::MOVE, seq++, STAGING_START), &sink);
+            }
+            ctx.exec(command(Msg::WRITE, seq++, 0xFFFFFFFF), &sink);
+        }
+        ctx.exec(command(Msg::POSITION, seq++, 0), &sink);
+    });
+    ctx.exec(command(Msg::LOCK_FLASH, seq++, 0), &sink);
+}
+
+int main(int argc, char** argv) {
+    s_filter = argc > 1 && argv[1][0] ? argv[1] : nullptr;
+    if (argc > 2) s_minTime = atoi(argv[2]) / 1000.0;
+
+    if (flash::map(nullptr)) {
+        fprintf(stderr, "could not map the flash\n");
+        return 1;
+    }
+
+    buffers();
+    checksums();
+    frames();
+    dispatch();
+    return 0;
+}
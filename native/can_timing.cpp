@@ -0,0 +1,38 @@
+#include "CanTiming.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace bootloader::can;
+
+// Prints what the bit timing solver picks for the common bitrates,
+// fails if one of them can't be hit off the F777's APB1 clock:
+//
+//   can-timing [sample point in permille] [apb1 clock in Hz]
+int main(int argc, char** argv) {
+    uint32_t samplePoint = argc > 1 ? atoi(argv[1]) : 875;
+    uint32_t clocks[] = {54000000, 45000000, 42000000, 36000000, 16000000};
+    // (800k doesn't divide the 54MHz)
+    uint32_t rates[] = {10000, 20000, 50000, 100000, 125000, 250000, 500000, 1000000};
+    if (argc > 2) clocks[0] = atoi(argv[2]);
+
+    bool good = true;
+    for (uint32_t clk : clocks) {
+        printf("%u Hz\n", clk);
+        for (uint32_t rate : rates) {
+            BitTiming t;
+            if (!bit_timing(clk, rate, samplePoint, &t)) {
+                printf("  %7u: none\n", rate);
+                if (clk == clocks[0]) good = false;
+                continue;
+            }
+            uint32_t sp = sample_point(t);
+            printf("  %7u: prescaler %4u bs1 %2u bs2 %u sjw %u, sample point %u.%u%%\n",
+                    rate, t.prescaler, t.bs1, t.bs2, t.sjw, sp / 10, sp % 10);
+            // Off by more than a quantum is a bad fit
+            int err = abs((int) sp - (int) samplePoint);
+            if (clk == clocks[0] && err > 1000 / (1 + t.bs1 + t.bs2)) good = false;
+        }
+    }
+    return good ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+#include "Bootloader.hpp"
+#include "Flash.hpp"
+#include "Udp.hpp"
+#include "Tcp.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace bootloader;
+using namespace bootloader::udp;
+using namespace bootloader::tcp;
+
+// Same layout as the board
+#define APP_START 0x08080000
+#define STAGING_START 0x08140000
+#define SLOT_SIZE (STAGING_START - APP_START)
+
+// Runs the bootloader protocol on the host, over udp, with the
+// flash emulated (in a file if one is given so it outlasts resets).
+// A tcp:<port> speaks the uart framing over tcp instead:
+//
+//   native-bootloader [port|tcp:port] [flash file] [board id]
+int main(int argc, char** argv) {
+    bool useTcp = argc > 1 && !strncmp(argv[1], "tcp:", 4);
+    uint16_t port = argc > 1 ? atoi(argv[1] + (useTcp ? 4 : 0)) : DEFAULT_PORT;
+    const char* flashFile = argc > 2 ? argv[2] : nullptr;
+    int boardId = argc > 3 ? atoi(argv[3]) : 0;
+
+    if (flash::map(flashFile)) {
+        fprintf(stderr, "could not map the flash\n");
+        return 1;
+    }
+
+    Conn* conn = useTcp ? (Conn*) new Tcp(port) : (Conn*) new Udp(port);
+    if (!conn->isOpen()) {
+        fprintf(stderr, "could not bind to port %d\n", port);
+        return 1;
+    }
+
+    Conn* conns[] = {conn};
+    Context ctx((uint8_t*) APP_START, (uint8_t*) STAGING_START, SLOT_SIZE,
+                boardId, conns, 1);
+    while (true) ctx.poll();
+}
@@ -0,0 +1,91 @@
+#include "Bootloader.hpp"
+#include "Flash.hpp"
+#include "SpiLoopback.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace bootloader;
+using namespace bootloader::spi;
+
+#define APP_START 0x08080000
+#define STAGING_START 0x08140000
+#define SLOT_SIZE (STAGING_START - APP_START)
+
+#define BOARD_ID 1
+
+// Writes an image into the staging slot through a Context on the
+// loopback, the way a supervisor would over SPI, then checks the
+// flash and that nothing had to be dropped for lack of room:
+//
+//   spi-loopback [bytes] [spi clock in Hz]
+static Loopback s_spi;
+static Context* s_ctx;
+static uint8_t s_seq = 0;
+static size_t s_replies = 0;
+
+static Msg command(Msg::Type type, uint32_t value) {
+    Msg m;
+    m.setID(BOARD_ID);
+    m.setType(type);
+    m.setSeqNum(s_seq++);
+    m.setLength(4);
+    m.setValue(value);
+    return m;
+}
+
+// Clocks blocks until the slave has taken everything
+// queued and handled it, counting the OKAYs that come back
+static void run() {
+    Link& master = s_spi.master();
+    do {
+        s_spi.exchange();
+        while (s_spi.hasData() || s_ctx->busy()) s_ctx->poll();
+        while (master.hasData()) {
+            Msg r = master.pop();
+            if (r.getType() == Msg::OKAY) s_replies++;
+        }
+    } while (!s_spi.idle());
+}
+
+static void send(const Msg& m) {
+    while (!s_spi.master().push(m)) run();
+}
+
+int main(int argc, char** argv) {
+    size_t len = argc > 1 ? atoi(argv[1]) : 256 * 1024;
+    double clock = argc > 2 ? atof(argv[2]) : 20e6;
+    len = (len + 3) & ~3;
+    if (len > SLOT_SIZE) len = SLOT_SIZE;
+
+    if (flash::map(nullptr)) {
+        fprintf(stderr, "could not map the flash\n");
+        return 1;
+    }
+    Conn* conns[] = {&s_spi};
+    Context ctx((uint8_t*) APP_START, (uint8_t*) STAGING_START, SLOT_SIZE,
+                BOARD_ID, conns, 1);
+    s_ctx = &ctx;
+
+    uint8_t* image = (uint8_t*) malloc(len);
+    for (size_t i = 0; i < len; i++) image[i] = rand();
+
+    size_t start = s_spi.exchange();
+    send(command(Msg::UNLOCK_FLASH, 0));
+    send(command(Msg::MOVE_START, 0));
+    for (size_t i = 0; i < len; i += 4) {
+        uint32_t word;
+        memcpy(&word, image + i, 4);
+        send(command(Msg::WRITE, word));
+    }
+    send(command(Msg::LOCK_FLASH, 0));
+    run();
+    size_t blocks = s_spi.exchange() - start;
+
+    bool good = s_replies == 3 && !memcmp((const uint8_t*) STAGING_START, image, len);
+    double seconds = blocks * BLOCK_SIZE * 8 / clock;
+    printf("%s: %zu bytes in %zu blocks of %zu, %.0f bytes/s at %.0f Hz\n",
+            good ? "ok" : "FAILED", len, blocks, BLOCK_SIZE, len / seconds, clock);
+    return good ? 0 : 1;
+}
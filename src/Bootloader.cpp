@@ -1,58 +1,212 @@
 #include "Bootloader.hpp"
 #include "Flash.hpp"
+#include "Image.hpp"
+#include "System.hpp"
 
+#if !defined(BOOTLOADER_NATIVE)
 #include <stm32f7xx_hal.h>
 
-
 #define DEBUG_LEDS
+#endif
 
 namespace bootloader {
     Mode getMode() {
-        RTC_HandleTypeDef rtc_handle;
-        rtc_handle.Instance = RTC;
-        return HAL_RTCEx_BKUPRead(&rtc_handle, RTC_BKP_DR0) ? Mode::BOOTLOADER : Mode::APP;
+        return system::read_backup(0) ? Mode::BOOTLOADER : Mode::APP;
     }
 
     void setMode(Mode m) {
-        RTC_HandleTypeDef rtc_handle;
-        rtc_handle.Instance = RTC;
-        HAL_PWR_EnableBkUpAccess();
-        HAL_RTCEx_BKUPWrite(&rtc_handle, RTC_BKP_DR0, m == Mode::BOOTLOADER ? 1 : 0);
-        HAL_PWR_DisableBkUpAccess();
+        system::write_backup(0, m == Mode::BOOTLOADER ? 1 : 0);
     }
 
-    Context::Context(uint8_t* appStart, int boardId,
-                        Conn** conns, int numConns) : _boardId(boardId),
-                                      _appStart(appStart),
+    void
+    Conn::writeBulk(board_id id, const uint8_t* data, size_t len) {
+        Msg m;
+        m.setType(Msg::READ);
+        m.setID(id);
+        for (size_t i = 0; i < len; i += 4) {
+            size_t n = len - i < 4 ? len - i : 4;
+            m.setValue(0);
+            for (size_t j = 0; j < n; j++) m.setData(j, data[i + j]);
+            m.setLength(n);
+            (*this) << m;
+        }
+    }
+
+    Context::Context(uint8_t* appStart, uint8_t* stagingStart, size_t slotSize,
+                        int boardId, Conn** conns, int numConns) : _boardId(boardId),
+                                      _slots{appStart, stagingStart},
+                                      _slotSize(slotSize),
                                       _conns(conns),
                                       _numConns(numConns),
-                                      _seqNum(0),
+                                      _nextConn(0),
+                                      _peekedConn(-1),
+                                      _forwardDrops(0),
+                                      _streamStart(nullptr),
+                                      _streamLen(0),
+                                      _baudReq(0),
                                       _resetReq(false),
-                                      _isWriting(false),
-                                      _position(appStart) {}
+                                      _debugLeds(false) {
+        if (_numConns > MAX_CONNS) system::breakpoint(); // Too many connections
+        if (_boardId >= Msg::MIN_GROUP_ID) system::breakpoint(); // Group id
+        for (int i = 0; i < MAX_CONNS; i++) {
+            _sessions[i].slotStart = stagingStart;
+            _sessions[i].position = stagingStart;
+        }
+        flash::set_idle_hook(&Context::flashIdle, this);
+    }
 
-    void 
+    ITCM_FUNC void
     Context::exec(const Msg& cmd, Conn* conn) {
+        #ifdef MSG_HISTORY
         _history.put(cmd);
-        Msg::Type type = cmd.getType();
+        #endif
 
-        Msg result;
-        result.setType(Msg::INVALID);
-        result.setID(_boardId);
-        result.setSeqNum(cmd.getSeqNum());
-        result.setLength(4); // Use all 4 bytes
+        // Sent to everyone in the group, not part of any session's sequence
+        if (inGroup(cmd) && cmd.getID() != _boardId) {
+            handleGroup(cmd);
+            return;
+        }
+
+        int idx = 0;
+        while (idx < _numConns - 1 && _conns[idx] != conn) idx++;
+        Session& s = _sessions[idx];
 
         if (cmd.getType() == Msg::STATUS) {
+            Msg result;
             result.setType(Msg::ACK);
-            result.setData(3, _seqNum);
+            result.setID(_boardId);
+            result.setSeqNum(cmd.getSeqNum());
+            result.setLength(4);
+            result.setData(3, s.seqNum);
             (*conn) << result;
             return;
         }
 
+        if (cmd.getType() == Msg::PARITY) {
+            repair(cmd, s);
+            runHeld(s, conn);
+            return;
+        }
+
         // Check the sequence number
-        if (_seqNum != cmd.getSeqNum()) {
+        if (s.seqNum != cmd.getSeqNum()) {
+            // A PARITY might fill in the gap before it
+            if (cmd.getType() == Msg::WRITE &&
+                    (uint8_t) (cmd.getSeqNum() - s.seqNum) < FEC_WINDOW) {
+                keepWrite(s, cmd.getSeqNum(), cmd.getValue(), true);
+            }
             return;
         }
+        execInSeq(cmd, s, conn);
+        // Whatever came early might be next
+        if (cmd.getType() == Msg::WRITE) runHeld(s, conn);
+    }
+
+    ITCM_FUNC void
+    Context::execInSeq(const Msg& cmd, Session& s, Conn* conn) {
+        // Increment the sequence number (with 255 rollover definitely right)
+        s.seqNum = (uint8_t) (((uint16_t) s.seqNum + 1) % 256);
+
+        // Anything but a WRITE ends the stream a PARITY could be for
+        if (cmd.getType() == Msg::WRITE) {
+            keepWrite(s, cmd.getSeqNum(), cmd.getValue(), false);
+        } else {
+            s.fecHave = 0;
+            s.fecHeld = 0;
+        }
+
+        Msg result;
+        if (cmd.getType() == Msg::BATCH) {
+            s.batchLen = 0;
+            s.batchCount = 0;
+            if (cmd.getData(0) > 0 && cmd.getData(0) <= Msg::MAX_BATCH) {
+                // Reply once the whole batch is in
+                s.batchLen = cmd.getData(0);
+                return;
+            }
+            result.setType(Msg::ERROR);
+            result.setID(_boardId);
+            result.setSeqNum(cmd.getSeqNum());
+            result.setLength(4);
+        } else if (s.batchLen) {
+            s.batch[s.batchCount++] = cmd;
+            if (s.batchCount < s.batchLen) return;
+            result = runBatch(s);
+            s.batchLen = 0;
+            s.batchCount = 0;
+        } else if (cmd.getType() == Msg::SET_BAUD) {
+            // Needs the conn, so not in handle()
+            result.setID(_boardId);
+            result.setSeqNum(cmd.getSeqNum());
+            result.setLength(4);
+            result.setValue(cmd.getValue());
+            if (conn->baudValid(cmd.getValue())) {
+                result.setType(Msg::OKAY);
+                _baudReq = cmd.getValue();
+            } else {
+                result.setType(Msg::ERROR);
+            }
+        } else {
+            result = handle(cmd, s);
+        }
+
+        // Send back the result
+        if (result.getType() != Msg::INVALID)
+            (*conn) << result;
+
+        if (_streamLen) {
+            conn->writeBulk(_boardId, _streamStart, _streamLen);
+            _streamLen = 0;
+        }
+        if (_baudReq) {
+            conn->setBaud(_baudReq);
+            _baudReq = 0;
+        }
+    }
+
+    Msg
+    Context::runBatch(Session& s) {
+        const Msg& last = s.batch[s.batchCount - 1];
+        Msg result;
+        result.setType(Msg::OKAY);
+        result.setID(_boardId);
+        result.setSeqNum(last.getSeqNum());
+        result.setLength(4);
+
+        for (uint8_t i = 0; i < s.batchCount; i++) {
+            Msg r = handle(s.batch[i], s);
+            if (r.getType() == Msg::ERROR) {
+                result.setType(Msg::ERROR);
+                result.setValue(0);
+                result.setData(0, i);
+                result.setData(1, r.getData(0));
+                _streamLen = 0;
+                break;
+            }
+            if (r.getType() != Msg::INVALID) {
+                result.setType(r.getType());
+                result.setData(r.getData());
+            }
+        }
+        return result;
+    }
+
+    ITCM_FUNC Msg
+    Context::handle(const Msg& cmd, Session& s) {
+        Msg::Type type = cmd.getType();
+
+        Msg result;
+        result.setType(Msg::INVALID);
+        result.setID(_boardId);
+        result.setSeqNum(cmd.getSeqNum());
+        result.setLength(4); // Use all 4 bytes
+
+        // Anything but another write is a sync point
+        if (type != Msg::WRITE && !sync(s)) {
+            result.setType(Msg::ERROR);
+            result.setData(0, 1);
+            return result;
+        }
 
         switch(type) {
             case Msg::PING:
@@ -80,81 +234,358 @@ namespace bootloader {
                 }
                 break;
             case Msg::UNLOCK_FLASH:
-                _isWriting = true;
-                _position = _appStart;
+                s.isWriting = true;
+                s.position = s.slotStart;
+                if (_hash.session == &s) _hash.session = nullptr;
                 flash::unlock();
 
                 result.setType(Msg::OKAY);
                 break;
             case Msg::LOCK_FLASH:
-                _isWriting = false;
-                _position = _appStart;
-                flash::lock();
+                endWrite(s);
 
                 result.setType(Msg::OKAY);
                 break;
             case Msg::MOVE:
-                _position = (uint8_t*) cmd.getValue();
+                s.position = (uint8_t*) (size_t) cmd.getValue();
                 result.setType(Msg::OKAY);
-                result.setValue((uint32_t) _position);
+                result.setValue((uint32_t) (size_t) s.position);
                 break;
             case Msg::MOVE_START:
-                _position = _appStart;
+                s.position = s.slotStart;
                 result.setType(Msg::OKAY);
-                result.setValue((uint32_t) _position);
+                result.setValue((uint32_t) (size_t) s.position);
                 break;
             case Msg::POSITION:
                 result.setType(Msg::OKAY);
-                result.setValue((uint32_t) _position);
+                result.setValue((uint32_t) (size_t) s.position);
                 break;
             case Msg::READ:
                 result.setType(Msg::READ);
-                result.setValue((*((uint32_t*) _position)));
-                _position = _position + 4; // Forward 4 bytes
+                result.setValue((*((uint32_t*) s.position)));
+                s.position = s.position + 4; // Forward 4 bytes
+                break;
+            case Msg::READ_STREAM:
+                // Only from within the slot
+                if (s.position < s.slotStart || s.position > s.slotStart + _slotSize ||
+                        cmd.getValue() > (size_t) (s.slotStart + _slotSize - s.position)) {
+                    result.setType(Msg::ERROR);
+                    break;
+                }
+                _streamStart = s.position;
+                _streamLen = cmd.getValue();
+                s.position = s.position + _streamLen;
+                result.setType(Msg::OKAY);
+                result.setValue(_streamLen);
                 break;
             case Msg::WRITE:
-                if (_isWriting && _position >= _appStart) {
-                    if (flash::write(_position, cmd.getValue())) {
-                        _isWriting = false;
-                        _position = _appStart;
-                        flash::lock();
-
-                        result.setType(Msg::ERROR);
-                        result.setData(0, 1);
-                    } else {
-                        result.setType(Msg::INVALID);
-                    }
+                if (s.isWriting && s.position >= s.slotStart &&
+                        s.position + 4 <= s.slotStart + _slotSize) {
+                    // Errors show up at the next sync point
+                    bufferWrite(s, cmd.getValue());
+                    result.setType(Msg::INVALID);
                 } else {
-                    _isWriting = false;
-                    _position = _appStart;
-                    flash::lock();
+                    sync(s);
+                    endWrite(s);
                     result.setType(Msg::ERROR);
                     result.setData(0, 2);
                 }
-                _position = _position + 4;
+                s.position = s.position + 4;
                 break;
             case Msg::ERASE:
-                if (flash::erase(_appStart, (size_t) cmd.getValue())) {
+                if (_hash.session == &s) _hash.session = nullptr;
+                if (cmd.getValue() > _slotSize ||
+                        flash::erase(s.slotStart, (size_t) cmd.getValue())) {
                     result.setType(Msg::ERROR);
                 } else {
                     result.setType(Msg::OKAY);
                 }
                 break;
+            case Msg::BLANK_CHECK: {
+                uint32_t mask;
+                int count;
+                if (cmd.getValue() > _slotSize ||
+                        flash::blank_sectors(s.slotStart, (size_t) cmd.getValue(), &mask, &count)) {
+                    result.setType(Msg::ERROR);
+                } else {
+                    result.setType(Msg::OKAY);
+                    result.setValue(mask);
+                    result.setData(3, (uint8_t) count);
+                }
+                break;
+            }
+            case Msg::IMAGE_INFO: {
+                // Don't try to verify (and mark) a half written image
+                bool valid = image::verified(s.slotStart, _slotSize);
+                if (!valid && !s.isWriting) {
+                    _hash.session = nullptr; // Needs the hash unit
+                    valid = image::verify(s.slotStart, _slotSize);
+                }
+                if (valid) {
+                    const image::Header* h = image::header(s.slotStart);
+                    result.setType(Msg::OKAY);
+                    switch (cmd.getData(0)) {
+                        case Msg::IMAGE_SIZE: result.setValue(h->size); break;
+                        case Msg::IMAGE_CRC: result.setValue(h->crc); break;
+                        case Msg::IMAGE_VERSION: result.setValue(h->version); break;
+                        case Msg::IMAGE_BUILD_HASH: result.setValue(h->buildHash); break;
+                        default: result.setType(Msg::ERROR);
+                    }
+                } else {
+                    result.setType(Msg::ERROR);
+                }
+                break;
+            }
+            case Msg::SET_SLOT:
+                // An app side context has no app slot
+                if (cmd.getData(0) <= (uint8_t) Slot::STAGING && !s.isWriting &&
+                        _slots[cmd.getData(0)]) {
+                    s.slotStart = _slots[cmd.getData(0)];
+                    s.position = s.slotStart;
+                    result.setType(Msg::OKAY);
+                    result.setValue((uint32_t) (size_t) s.slotStart);
+                } else {
+                    result.setType(Msg::ERROR);
+                }
+                break;
+            case Msg::GROUP_JOIN: {
+                uint32_t blocks = cmd.getData(1) | (cmd.getData(2) << 8);
+                if (!cmd.getData(0)) {
+                    _group.id = 0;
+                    result.setType(Msg::OKAY);
+                } else if (cmd.getData(0) < Msg::MIN_GROUP_ID || !s.isWriting ||
+                        blocks > Msg::MAX_GROUP_BLOCKS || (size_t) s.position % 4 ||
+                        s.position < s.slotStart ||
+                        s.position + blocks * Msg::GROUP_BLOCK_SIZE > s.slotStart + _slotSize) {
+                    result.setType(Msg::ERROR);
+                } else {
+                    _group.id = cmd.getData(0);
+                    _group.session = &s;
+                    _group.base = s.position;
+                    _group.blocks = blocks;
+                    _group.block = Group::NO_BLOCK;
+                    for (uint32_t i = 0; i < Msg::MAX_GROUP_BLOCKS / 32; i++) {
+                        uint32_t first = i * 32;
+                        _group.missing[i] = first >= blocks ? 0 :
+                                    blocks - first >= 32 ? 0xFFFFFFFF :
+                                    (1u << (blocks - first)) - 1;
+                    }
+                    result.setType(Msg::OKAY);
+                    result.setValue((uint32_t) (size_t) s.position);
+                }
+                break;
+            }
+            case Msg::GROUP_MISSING:
+                if (!_group.id || _group.session != &s) {
+                    result.setType(Msg::ERROR);
+                } else {
+                    uint32_t missing = 0;
+                    for (uint32_t i = 0; i < (_group.blocks + 31) / 32; i++) {
+                        missing += __builtin_popcount(_group.missing[i]);
+                    }
+                    // (little-endian, so the words are the bytes in order)
+                    _streamStart = (const uint8_t*) _group.missing;
+                    _streamLen = (_group.blocks + 7) / 8;
+                    result.setType(Msg::OKAY);
+                    result.setValue(missing);
+                }
+                break;
+            case Msg::BATCH: // No nesting
+            case Msg::SET_BAUD: // Only on its own (see exec)
+            case Msg::GROUP_BLOCK: // Only to the group
+            case Msg::GROUP_WRITE:
+            case Msg::PARITY: // Not sequenced (see exec)
+                result.setType(Msg::ERROR);
+                break;
             case Msg::INVALID:
             default:
                 result.setType(Msg::INVALID);
         }
+        return result;
+    }
 
-        // Send back the result
-        if (result.getType() != Msg::INVALID)
-            (*conn) << result;
+    static_assert(Msg::GROUP_BLOCK_WORDS == 64, "A block's words are tracked in a uint64_t");
 
-        // Increment the sequence number (with 255 rollover definitely right)
-        _seqNum = (uint8_t) (((uint16_t) _seqNum + 1) % 256);
+    void
+    Context::handleGroup(const Msg& cmd) {
+        Session& s = *_group.session;
+        if (!s.isWriting) return; // Ended (i.e. LOCK_FLASH) since joining
+
+        if (cmd.getType() == Msg::GROUP_BLOCK) {
+            uint32_t b = cmd.getValue();
+            bool missing = b < _group.blocks && (_group.missing[b / 32] & (1u << (b % 32)));
+            _group.block = missing ? b : Group::NO_BLOCK;
+            _group.words = 0;
+        } else if (cmd.getType() == Msg::GROUP_WRITE) {
+            uint32_t b = _group.block;
+            uint8_t w = cmd.getSeqNum();
+            if (b == Group::NO_BLOCK || cmd.getLength() != (uint8_t) b ||
+                    w >= Msg::GROUP_BLOCK_WORDS || (_group.words & (1ull << w))) return;
+            _group.words |= 1ull << w;
+            s.position = _group.base + b * Msg::GROUP_BLOCK_SIZE + 4 * w;
+            bufferWrite(s, cmd.getValue());
+            if (_group.words == ~0ull) {
+                _group.missing[b / 32] &= ~(1u << (b % 32));
+                _group.block = Group::NO_BLOCK;
+            }
+        }
+    }
+
+    static_assert(Context::FEC_WINDOW <= 32 && !(Context::FEC_WINDOW & (Context::FEC_WINDOW - 1)),
+                  "The FEC slots are tracked in a uint32_t");
+    static_assert(Msg::MAX_FEC_GROUP <= Context::FEC_WINDOW, "A PARITY's group has to fit");
+
+    ITCM_FUNC void
+    Context::keepWrite(Session& s, uint8_t seqNum, uint32_t value, bool held) {
+        uint8_t i = seqNum % FEC_WINDOW;
+        s.fecValues[i] = value;
+        s.fecSeqs[i] = seqNum;
+        s.fecHave |= 1u << i;
+        if (held) s.fecHeld |= 1u << i;
+        else s.fecHeld &= ~(1u << i);
     }
 
     void
-    Context::run() {
+    Context::repair(const Msg& parity, Session& s) {
+        uint8_t n = parity.getLength();
+        if (!n || n > Msg::MAX_FEC_GROUP) return;
+
+        uint32_t value = parity.getValue();
+        int missing = -1;
+        for (uint8_t k = 0; k < n; k++) {
+            uint8_t seq = parity.getSeqNum() + k;
+            uint8_t i = seq % FEC_WINDOW;
+            if ((s.fecHave & (1u << i)) && s.fecSeqs[i] == seq) {
+                value ^= s.fecValues[i];
+            } else if (missing < 0 && (uint8_t) (seq - s.seqNum) < FEC_WINDOW) {
+                missing = seq;
+            } else {
+                return; // Too many gone, or run too long ago
+            }
+        }
+        if (missing < 0) return;
+        keepWrite(s, (uint8_t) missing, value, true);
+    }
+
+    ITCM_FUNC void
+    Context::runHeld(Session& s, Conn* conn) {
+        Msg m;
+        m.setID(_boardId);
+        m.setType(Msg::WRITE);
+        m.setLength(4);
+        while (true) {
+            uint8_t i = s.seqNum % FEC_WINDOW;
+            if (!(s.fecHeld & (1u << i)) || s.fecSeqs[i] != s.seqNum) break;
+            m.setSeqNum(s.seqNum);
+            m.setValue(s.fecValues[i]);
+            execInSeq(m, s, conn);
+        }
+    }
+
+    void
+    Context::endWrite(Session& s) {
+        if (_hash.session == &s) finishHash(s);
+        s.isWriting = false;
+        s.position = s.slotStart;
+        for (int i = 0; i < _numConns; i++) {
+            // (marking an image verified locks it)
+            if (_sessions[i].isWriting) {
+                flash::unlock();
+                return;
+            }
+        }
+        flash::lock();
+    }
+
+    void
+    Context::hashWritten(Session& s, const uint8_t* start, const uint8_t* end) {
+        const uint8_t* entry = image::entry(s.slotStart);
+        if (end <= entry) return; // The header
+        if (_hash.session != &s) {
+            // Only from the start, and one image at a time
+            if (_hash.session || start != entry) return;
+            _hash.session = &s;
+            _hash.next = entry;
+            _hash.sha.start();
+        }
+        if (start < _hash.next) {
+            // Rewritten, verify() has to do it all
+            _hash.session = nullptr;
+            return;
+        }
+        // Whole blocks up to what has been written, gaps (erased runs
+        // the client skipped) get hashed as whatever the flash holds
+        size_t len = (end - _hash.next) & ~(size_t) 63;
+        _hash.sha.update(_hash.next, len);
+        _hash.next += len;
+    }
+
+    void
+    Context::finishHash(Session& s) {
+        _hash.session = nullptr;
+        if (!image::present(s.slotStart, _slotSize)) return;
+        const uint8_t* end = image::entry(s.slotStart) + image::header(s.slotStart)->size;
+        if (end < _hash.next) return; // Hashed past the end
+        uint8_t digest[image::DIGEST_SIZE];
+        _hash.sha.update(_hash.next, end - _hash.next);
+        _hash.sha.finish(digest);
+        image::accept(s.slotStart, _slotSize, digest);
+    }
+
+    void
+    Context::bufferWrite(Session& s, uint32_t value) {
+        if (s.writeError) return; // Dropped until reported
+        // Only contiguous words make a burst
+        if (s.burstLen && s.position != s.burstStart + 4 * s.burstLen) programBurst(s);
+        if ((size_t) s.position % 4) {
+            if (flash::write(s.position, value)) s.writeError = true;
+            else hashWritten(s, s.position, s.position + 4);
+            return;
+        }
+
+        if (!s.burstLen) s.burstStart = s.position;
+        s.burst[s.burstLen++] = value;
+        if (((size_t) s.position + 4) % WRITE_BURST == 0) programBurst(s);
+    }
+
+    void
+    Context::programBurst(Session& s) {
+        if (!s.burstLen) return;
+        if (flash::program(s.burstStart, s.burst, s.burstLen)) s.writeError = true;
+        else hashWritten(s, s.burstStart, s.burstStart + 4 * s.burstLen);
+        s.burstLen = 0;
+        s.idleLen = 0;
+    }
+
+    bool
+    Context::sync(Session& s) {
+        programBurst(s);
+        if (!s.writeError) return true;
+        s.writeError = false;
+        endWrite(s);
+        return false;
+    }
+
+    void
+    Context::idle() {
+        // Not just because the next frame isn't in yet, on a uart or can
+        // bus every WRITE would go out as a burst of its own then
+        // (timed from here so that WRITEs don't have to read the clock)
+        uint32_t now = system::millis();
+        for (int i = 0; i < _numConns; i++) {
+            Session& s = _sessions[i];
+            if (!s.burstLen) continue;
+            if (s.burstLen != s.idleLen) {
+                s.idleLen = s.burstLen;
+                s.idleSince = now;
+            } else if (now - s.idleSince >= BURST_IDLE_MS) {
+                programBurst(s);
+            }
+        }
+    }
+
+    void
+    Context::initLeds() {
         #ifdef DEBUG_LEDS
         // Debug LED 1
         GPIO_InitTypeDef pin;
@@ -178,68 +609,181 @@ namespace bootloader {
         pin.Pull = GPIO_NOPULL;
         pin.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
         HAL_GPIO_Init(GPIOB, &pin);
+        _debugLeds = true;
         #endif
+    }
 
-        Msg msg;
+    void
+    Context::run() {
+        initLeds();
+        // poll() resets for us
+        while (true) poll();
+    }
+
+    void
+    Context::task(void* ctx) {
+        Context* c = (Context*) ctx;
+        while (true) c->poll();
+    }
+
+    void
+    Context::poll() {
+        if (_numConns <= 0) system::breakpoint(); // No connections! reset
+
+        drain();
+        // What came in while the last command ran goes first
+        if (runQueued()) return;
+
+        const Msg* msg = nullptr; // In place if the conn supports it
+        Msg read;
+        bool peeked = false;
         Conn* src = nullptr; // Conn msg came from
-        while (!_resetReq) {
-            if (_numConns <= 0) asm("bkpt 255"); // No connections! reset
-            // Check to see if any of the connections
-            // are ready to read
-            for (int i = 0; i < _numConns; i++) {
-                Conn* c = _conns[i];
-                if (c->hasData()) {
-                    (*c) >> msg;
-                    // If there was an
-                    // error reading, just go on
-                    if (msg.hasError()) {
-                        // Toggle red led for error
-                        #ifdef DEBUG_LEDS
-                        HAL_GPIO_TogglePin(GPIOB, GPIO_PIN_14);
-                        #endif
-                        continue;
-                    }
-                    src = c;
-                    break;
+        int srcIdx = 0;
+        uint32_t frameStart = 0; // Cycle count when the frame started parsing
+        // Check to see if any of the connections
+        // are ready to read
+        for (int k = 0; k < _numConns; k++) {
+            int i = (_nextConn + k) % _numConns;
+            Conn* c = _conns[i];
+            if (c->hasData()) {
+                frameStart = frameCycle();
+                msg = c->peek();
+                peeked = msg != nullptr;
+                if (!peeked) {
+                    (*c) >> read;
+                    msg = &read;
                 }
+                // If there was an
+                // error reading, just go on
+                if (msg->hasError()) {
+                    if (peeked) c->release();
+                    readFailed();
+                    continue;
+                }
+                src = c;
+                srcIdx = i;
+                _nextConn = (i + 1) % _numConns;
+                break;
             }
-            if (!src) continue; // Try to read again
+        }
+        if (!src) {
+            idle();
+            return;
+        }
 
-            // Toggle green led when reading
-            #ifdef DEBUG_LEDS
-            HAL_GPIO_TogglePin(GPIOB, GPIO_PIN_0);
-            #endif
+        if (received(*msg)) forward(*msg, srcIdx);
+        // pump() leaves src alone while msg is in it
+        if (peeked) setPeeked(srcIdx);
+        process(*msg, src, frameStart);
+        if (peeked) {
+            setPeeked(-1);
+            src->release();
+        }
+    }
 
-            // Check if we should handle this message
-            bool handle = msg.getID() == _boardId || msg.hasError() ||
-                          msg.getType() == Msg::PING;
-            bool forward = !handle || msg.getType() == Msg::PING;
-
-            if (forward) {
-                // Transmit result/forward msg
-                for (int i = 0; i < _numConns; i++) {
-                    Conn* c = _conns[i];
-                    if (c == src) continue;
-                    (*c) << msg;
-                }
+    ITCM_FUNC void
+    Context::forward(const Msg& msg, int src) {
+        for (int i = 0; i < _numConns; i++) {
+            if (i == src) continue;
+            if (_out[i].empty() && _conns[i]->getWriteWindow()) {
+                (*_conns[i]) << msg;
+            } else {
+                queueOut(msg, i);
             }
+        }
+    }
 
-            if (handle) {
-                // Toggle blue LED when processing message
-                #ifdef DEBUG_LEDS
-                HAL_GPIO_TogglePin(GPIOB, GPIO_PIN_7);
-                #endif
-                exec(msg, src);
+    ITCM_FUNC void
+    Context::drain() {
+        for (int i = 0; i < _numConns; i++) {
+            Buffer<Msg, OUT_QUEUE>& q = _out[i];
+            while (!q.empty() && _conns[i]->getWriteWindow()) {
+                (*_conns[i]) << q.front();
+                q.drop();
             }
-            src = nullptr;
         }
-        // Flush the connections
-        // before we reset
-        for (int i = 0; i < _numConns; i++) {
+    }
+
+    ITCM_FUNC void
+    Context::pump() {
+        drain();
+        // A frame from each conn per call
+        for (int i = 0; i < _numConns && localRoom(); i++) {
             Conn* c = _conns[i];
-            c->flush();
+            if (isPeeked(i) || !c->hasData()) continue;
+            const Msg* msg = c->peek();
+            bool peeked = msg != nullptr;
+            Msg read;
+            if (!peeked) {
+                (*c) >> read;
+                msg = &read;
+            }
+            if (msg->hasError()) {
+                readFailed();
+            } else {
+                if (received(*msg)) forward(*msg, i);
+                if (handles(*msg)) queueLocal(*msg, i);
+            }
+            if (peeked) c->release();
         }
-        NVIC_SystemReset();
     }
-}
 
+    bool
+    Context::runQueued() {
+        if (_local.empty()) return false;
+        Queued q = _local.pop(); // (copied, a flash op can queue more)
+        process(q.msg, _conns[q.src], frameCycle());
+        return true;
+    }
+
+    ITCM_FUNC void
+    Context::flashIdle(void* ctx) {
+        ((Context*) ctx)->pump();
+    }
+
+    // These two run during an erase too (StaticContext's busy
+    // hook), so the leds get toggled without the hal (in flash)
+    ITCM_FUNC void
+    Context::readFailed() {
+        // Toggle red led for error
+        #ifdef DEBUG_LEDS
+        if (_debugLeds) GPIOB->ODR ^= GPIO_PIN_14;
+        #endif
+    }
+
+    ITCM_FUNC bool
+    Context::received(const Msg& msg) {
+        // Toggle green led when reading
+        #ifdef DEBUG_LEDS
+        if (_debugLeds) GPIOB->ODR ^= GPIO_PIN_0;
+        #endif
+        return !handles(msg) || msg.getType() == Msg::PING || inGroup(msg);
+    }
+
+    void
+    Context::process(const Msg& msg, Conn* src, uint32_t frameStart) {
+        if (handles(msg)) {
+            // Toggle blue LED when processing message
+            #ifdef DEBUG_LEDS
+            if (_debugLeds) HAL_GPIO_TogglePin(GPIOB, GPIO_PIN_7);
+            #endif
+            exec(msg, src);
+        }
+        #ifdef FRAME_TIMING
+        _frameCycles.put(system::cycle_count() - frameStart);
+        #endif
+
+        if (_resetReq) {
+            // Other sessions' writes
+            for (int i = 0; i < _numConns; i++) programBurst(_sessions[i]);
+            drain(); // What's left to forward
+            // Flush the connections
+            // before we reset
+            for (int i = 0; i < _numConns; i++) {
+                Conn* c = _conns[i];
+                c->flush();
+            }
+            system::reset();
+        }
+    }
+}
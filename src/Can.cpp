@@ -1,16 +1,13 @@
 #include "Can.hpp"
+#include "CanTiming.hpp"
 #include "Buffer.hpp"
+#include "System.hpp"
 #include <stm32f7xx_hal.h>
 
 namespace bootloader {
     namespace can {
-        struct CanMsg {
-            bool ext; // Identifier extension bit for extended can
-            bool remote; // Remote transmission req. bit
-            uint32_t id; // Message ID (only 11 bits unless IDE set)
-            uint8_t length; // Number of bytes
-            uint8_t data[8]; // Message data
-        };
+        // Standard id all our frames go out with
+        constexpr uint32_t FRAME_ID = 1;
 
         // The actual backend for each
         // can bus
@@ -21,15 +18,22 @@ namespace bootloader {
                 _error = false;
             }
 
-            void open(const Pin& rx, const Pin& tx, int baud) {
+            void open(const Pin& rx, const Pin& tx, int baud, int samplePoint) {
                 _rxPin = rx;
                 _txPin = tx;
 
+                BitTiming t;
+                if (!bit_timing(HAL_RCC_GetPCLK1Freq(), baud, samplePoint, &t)) {
+                    asm("bkpt 255"); // Can't hit that bitrate off this clock
+                    return;
+                }
+
                 _handle.State = HAL_CAN_STATE_RESET;
-                _handle.Init.Prescaler = 6000000 / baud;
+                _handle.Init.Prescaler = t.prescaler;
                 _handle.Init.Mode = CAN_MODE_NORMAL;
-                _handle.Init.TimeSeg1 = CAN_BS1_6TQ;//consider increasing or decreasing, but not sure
-                _handle.Init.TimeSeg2 = CAN_BS2_2TQ;
+                _handle.Init.SyncJumpWidth = (uint32_t) (t.sjw - 1) << CAN_BTR_SJW_Pos;
+                _handle.Init.TimeSeg1 = (uint32_t) (t.bs1 - 1) << CAN_BTR_TS1_Pos;
+                _handle.Init.TimeSeg2 = (uint32_t) (t.bs2 - 1) << CAN_BTR_TS2_Pos;
                 _handle.Init.TimeTriggeredMode = DISABLE;
                 _handle.Init.AutoBusOff = ENABLE;
                 _handle.Init.AutoWakeUp = DISABLE;
@@ -144,7 +148,7 @@ namespace bootloader {
             // IRQs
 
             // On successful transmission
-            void _txIRQ() {
+            ITCM_FUNC void _txIRQ() {
                 uint32_t tsr = _handle.Instance->TSR;
                 if (tsr & CAN_TSR_RQCP0)
                     __HAL_CAN_CLEAR_FLAG(&_handle, CAN_FLAG_RQCP0);
@@ -160,75 +164,41 @@ namespace bootloader {
                 }
             }
 
-            void _rxIRQ(int fifo) {
-                CanMsg msg;
-                msg.ext = CAN_RI0R_IDE & _handle.Instance->sFIFOMailBox[fifo].RIR;
-                if (msg.ext) {
-                    msg.id = ((CAN_RI0R_EXID | CAN_RI0R_STID) &
-                                _handle.Instance->sFIFOMailBox[fifo].RIR) >> CAN_RI0R_EXID_Pos;
-                } else {
-                    msg.id = (CAN_RI0R_STID &
-                                _handle.Instance->sFIFOMailBox[fifo].RIR) >> CAN_RI0R_EXID_Pos;
-                }
-                msg.remote = CAN_RI0R_RTR & _handle.Instance->sFIFOMailBox[fifo].RIR;
-                msg.length = (CAN_RDT0R_DLC &
+            ITCM_FUNC void _rxIRQ(int fifo) {
+                // The 8 data bytes are the packet, so they go
+                // straight from the fifo into the rx buffer
+                // (we're in an interrupt so no one can interfere)
+                Msg* slot = _rxBuf.reserve();
+                if (slot) {
+                    Msg::Packet& p = slot->packet();
+                    p.words[0] = _handle.Instance->sFIFOMailBox[fifo].RDLR;
+                    p.words[1] = _handle.Instance->sFIFOMailBox[fifo].RDHR;
+                    uint32_t length = (CAN_RDT0R_DLC &
                                 _handle.Instance->sFIFOMailBox[fifo].RDTR) >> CAN_RDT0R_DLC_Pos;
-
-                msg.data[0] = (CAN_RDL0R_DATA0 & 
-                                _handle.Instance->sFIFOMailBox[fifo].RDLR) >> CAN_RDL0R_DATA0_Pos;
-                msg.data[1] = (CAN_RDL0R_DATA1 & 
-                                _handle.Instance->sFIFOMailBox[fifo].RDLR) >> CAN_RDL0R_DATA1_Pos;
-                msg.data[2] = (CAN_RDL0R_DATA2 & 
-                                _handle.Instance->sFIFOMailBox[fifo].RDLR) >> CAN_RDL0R_DATA2_Pos;
-                msg.data[3] = (CAN_RDL0R_DATA3 & 
-                                _handle.Instance->sFIFOMailBox[fifo].RDLR) >> CAN_RDL0R_DATA3_Pos;
-                msg.data[4] = (CAN_RDH0R_DATA4 & 
-                                _handle.Instance->sFIFOMailBox[fifo].RDHR) >> CAN_RDH0R_DATA4_Pos;
-                msg.data[5] = (CAN_RDH0R_DATA5 & 
-                                _handle.Instance->sFIFOMailBox[fifo].RDHR) >> CAN_RDH0R_DATA5_Pos;
-                msg.data[6] = (CAN_RDH0R_DATA6 & 
-                                _handle.Instance->sFIFOMailBox[fifo].RDHR) >> CAN_RDH0R_DATA6_Pos;
-                msg.data[7] = (CAN_RDH0R_DATA7 & 
-                                _handle.Instance->sFIFOMailBox[fifo].RDHR) >> CAN_RDH0R_DATA7_Pos;
+                    slot->setError(length != sizeof(Msg::Packet));
+                    _rxBuf.commit();
+                }
                 if (fifo == CAN_RX_FIFO0) {
                     SET_BIT(_handle.Instance->RF0R, CAN_RF0R_RFOM0);
                 } else if (fifo == CAN_RX_FIFO1) {
                     SET_BIT(_handle.Instance->RF1R, CAN_RF1R_RFOM1);
                 }
-
-                // Save to rx buffer
-                // we're in an interrupt
-                // so no one can interfere
-                _rxBuf.push(msg);
             }
 
-            void _transmit(const CanMsg& msg) {
+            ITCM_FUNC void _transmit(const Msg& msg) {
                 _transmitting = true;
                 const uint32_t mailbox = (_handle.Instance->TSR & CAN_TSR_CODE) >> CAN_TSR_CODE_Pos;
-                const uint8_t remoteTr = msg.remote ? CAN_RTR_REMOTE : CAN_RTR_DATA;
-                if (msg.ext) {
-                    _handle.Instance->sTxMailBox[mailbox].TIR = ((msg.id << CAN_TI0R_EXID_Pos) |
-                                                                  CAN_ID_EXT | remoteTr);
-                } else {
-                    _handle.Instance->sTxMailBox[mailbox].TIR = ((msg.id << CAN_TI0R_STID_Pos) |
-                                                                  remoteTr);
-                }
-                _handle.Instance->sTxMailBox[mailbox].TDTR = msg.length;
-
-                WRITE_REG(_handle.Instance->sTxMailBox[mailbox].TDHR,
-                          (static_cast<uint32_t>(msg.data[7]) << CAN_TDH0R_DATA7_Pos) |
-                          (static_cast<uint32_t>(msg.data[6]) << CAN_TDH0R_DATA6_Pos) |
-                          (static_cast<uint32_t>(msg.data[5]) << CAN_TDH0R_DATA5_Pos) |
-                          (static_cast<uint32_t>(msg.data[4]) << CAN_TDH0R_DATA4_Pos));
-                WRITE_REG(_handle.Instance->sTxMailBox[mailbox].TDLR,
-                          (static_cast<uint32_t>(msg.data[3]) << CAN_TDL0R_DATA3_Pos) |
-                          (static_cast<uint32_t>(msg.data[2]) << CAN_TDL0R_DATA2_Pos) |
-                          (static_cast<uint32_t>(msg.data[1]) << CAN_TDL0R_DATA1_Pos) |
-                          (static_cast<uint32_t>(msg.data[0]) << CAN_TDL0R_DATA0_Pos));
+                _handle.Instance->sTxMailBox[mailbox].TIR = ((FRAME_ID << CAN_TI0R_STID_Pos) |
+                                                              CAN_RTR_DATA);
+                _handle.Instance->sTxMailBox[mailbox].TDTR = sizeof(Msg::Packet);
+
+                const Msg::Packet& p = msg.pack();
+                WRITE_REG(_handle.Instance->sTxMailBox[mailbox].TDHR, p.words[1]);
+                WRITE_REG(_handle.Instance->sTxMailBox[mailbox].TDLR, p.words[0]);
                 SET_BIT(_handle.Instance->sTxMailBox[mailbox].TIR, CAN_TI0R_TXRQ);
             }
 
-            bool write(const CanMsg &msg) {
+            ITCM_FUNC bool write(const Msg &msg) {
                 // Wait until space to transmit
                 while (_txBuf.full()) {
                     if (!_transmitting) {
@@ -253,12 +223,12 @@ namespace bootloader {
                 while (_transmitting) {}
             }
 
-            bool hasData() const { // If there is a message in the line
+            ITCM_FUNC bool hasData() const { // If there is a message in the line
                 return !_rxBuf.empty();
             }
 
 
-            void read(CanMsg *dst) {
+            ITCM_FUNC void read(Msg *dst) {
                 while (!hasData()) {}
                 // No interrupting while we read from the buffer
                 //_irqDisable();
@@ -266,18 +236,26 @@ namespace bootloader {
                 //_irqEnable();
             }
 
+            // The next message where it sits in the rx buffer
+            ITCM_FUNC const Msg* peek() const {
+                return hasData() ? &_rxBuf.front() : nullptr;
+            }
+            ITCM_FUNC void release() {
+                _rxBuf.drop();
+            }
+
             size_t getReadWindow() const {
                 return _rxBuf.free();
             }
-            size_t getWriteWindow() const {
+            ITCM_FUNC size_t getWriteWindow() const {
                 return _txBuf.free();
             }
         private:
             CAN_HandleTypeDef _handle;
             Pin _rxPin;
             Pin _txPin;
-            Buffer<CanMsg, 256> _rxBuf;
-            Buffer<CanMsg, 256> _txBuf;
+            Buffer<Msg, 256> _rxBuf;
+            Buffer<Msg, 256> _txBuf;
             bool _transmitting;
             bool _error;
         };
@@ -300,30 +278,24 @@ namespace bootloader {
             return getCanIdx(handle->Instance);
         }
 
-        // Interrupts
-        extern "C" {
-            void HAL_CAN_MspInit(CAN_HandleTypeDef* handle) {
-                s_drivers[getHandleIdx(handle)]._mspInit();
-            }
-            void HAL_CAN_MspDeInit(CAN_HandleTypeDef* handle) {
-                s_drivers[getHandleIdx(handle)]._mspInit();
-            }
-            void CAN1_TX_IRQHandler() {
-                s_drivers[getCanIdx(CAN1)]._txIRQ();
-            }
-            void CAN1_RX0_IRQHandler() {
-                s_drivers[getCanIdx(CAN1)]._rxIRQ(CAN_RX_FIFO0);
-            }
-            void CAN1_RX1_IRQHandler() {
-                s_drivers[getCanIdx(CAN1)]._rxIRQ(CAN_RX_FIFO1);
-            }
-            void CAN1_SCE_IRQHandler() {} // Not used
+        // For the handlers in DriverInterrupts.cpp
+        void msp_init(CAN_HandleTypeDef* handle) {
+            s_drivers[getHandleIdx(handle)]._mspInit();
+        }
+        void msp_deinit(CAN_HandleTypeDef* handle) {
+            s_drivers[getHandleIdx(handle)]._mspInit();
+        }
+        ITCM_FUNC void tx_irq(CAN_TypeDef* instance) {
+            s_drivers[getCanIdx(instance)]._txIRQ();
+        }
+        ITCM_FUNC void rx_irq(CAN_TypeDef* instance, int fifo) {
+            s_drivers[getCanIdx(instance)]._rxIRQ(fifo);
         }
 
         // EXTERNAL API:
         Can::Can() : _idx(-1) {}
 
-        Can::Can(const Pin& rx, const Pin& tx, int baud) : _idx(-1) {
+        Can::Can(const Pin& rx, const Pin& tx, int baud, int samplePoint) : _idx(-1) {
             // Get the correct can number
             if ((rx == pins::PI9 || rx == pins::PH14 || rx == pins::PA11
                         || rx == pins::PD0 || rx == pins::PB8) &&
@@ -340,7 +312,7 @@ namespace bootloader {
                 _idx = 2;
             }
             #endif
-            if (_idx >= 0) s_drivers[_idx].open(rx, tx, baud);
+            if (_idx >= 0) s_drivers[_idx].open(rx, tx, baud, samplePoint);
         }
         Can::~Can() {}
 
@@ -355,7 +327,7 @@ namespace bootloader {
             return _idx >= 0;
         }
 
-        bool
+        ITCM_FUNC bool
         Can::hasData() const {
             if (_idx >= 0) {
                 return s_drivers[_idx].hasData();
@@ -371,7 +343,7 @@ namespace bootloader {
             return 0;
         }
 
-        size_t
+        ITCM_FUNC size_t
         Can::getWriteWindow() const {
             if (_idx >= 0) {
                 return s_drivers[_idx].getWriteWindow();
@@ -387,39 +359,32 @@ namespace bootloader {
         }
 
 
-        Conn&
+        ITCM_FUNC Conn&
         Can::operator<<(const Msg& w) {
-            Msg::Packet p = w.pack();
-            // Make a CAN frame
-            CanMsg m;
-            m.remote = false;
-            m.ext = false;
-            m.id = 1;
-            m.length = 8;
-            m.data[0] = p.buffer[0]; m.data[1] = p.buffer[1];
-            m.data[2] = p.buffer[2]; m.data[3] = p.buffer[3];
-            m.data[4] = p.buffer[4]; m.data[5] = p.buffer[5];
-            m.data[6] = p.buffer[6]; m.data[7] = p.buffer[7];
             if (_idx >= 0) {
-                s_drivers[_idx].write(m);
+                s_drivers[_idx].write(w);
                 //s_drivers[_idx].flush();
             }
             return *this;
         }
 
-        Conn&
+        ITCM_FUNC Conn&
         Can::operator>>(Msg& r) {
             if (_idx >= 0) {
-                CanMsg m;
-                s_drivers[_idx].read(&m);
-                Msg::Packet p;
-                p.buffer[0] = m.data[0]; p.buffer[1] = m.data[1];
-                p.buffer[2] = m.data[2]; p.buffer[3] = m.data[3];
-                p.buffer[4] = m.data[4]; p.buffer[5] = m.data[5];
-                p.buffer[6] = m.data[6]; p.buffer[7] = m.data[7];
-                r.unpack(p);
+                s_drivers[_idx].read(&r);
             }
             return *this;
         }
+
+        ITCM_FUNC const Msg*
+        Can::peek() {
+            if (_idx >= 0) return s_drivers[_idx].peek();
+            return nullptr;
+        }
+
+        ITCM_FUNC void
+        Can::release() {
+            if (_idx >= 0) s_drivers[_idx].release();
+        }
     }
 }
@@ -0,0 +1,58 @@
+#include "Uart.hpp"
+#include "Can.hpp"
+#include "Spi.hpp"
+#include "System.hpp"
+
+#include <stm32f7xx_hal.h>
+
+using namespace bootloader;
+
+// The drivers' interrupt handlers and HAL callbacks, kept out of the
+// library like Interrupts.cpp. An app that links the library and runs
+// some of these peripherals itself leaves this out and routes the
+// handlers for the ones the drivers use to uart::irq() and co
+extern "C" {
+    void HAL_UART_MspInit(UART_HandleTypeDef *uart) { uart::msp_init(uart); }
+    void HAL_UART_MspDeInit(UART_HandleTypeDef *uart) { uart::msp_deinit(uart); }
+
+    void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart) {}
+    void HAL_UART_TxHalfCpltCallback(UART_HandleTypeDef *huart) {}
+    void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {}
+
+    ITCM_FUNC void USART1_IRQHandler() { uart::irq(0); }
+    ITCM_FUNC void USART2_IRQHandler() { uart::irq(1); }
+    ITCM_FUNC void USART3_IRQHandler() { uart::irq(2); }
+    ITCM_FUNC void UART4_IRQHandler() { uart::irq(3); }
+    ITCM_FUNC void UART5_IRQHandler() { uart::irq(4); }
+    ITCM_FUNC void USART6_IRQHandler() { uart::irq(5); }
+    ITCM_FUNC void UART7_IRQHandler() { uart::irq(6); }
+    ITCM_FUNC void UART8_IRQHandler() { uart::irq(7); }
+
+    void HAL_CAN_MspInit(CAN_HandleTypeDef* handle) { can::msp_init(handle); }
+    void HAL_CAN_MspDeInit(CAN_HandleTypeDef* handle) { can::msp_deinit(handle); }
+
+    ITCM_FUNC void CAN1_TX_IRQHandler() { can::tx_irq(CAN1); }
+    ITCM_FUNC void CAN1_RX0_IRQHandler() { can::rx_irq(CAN1, CAN_RX_FIFO0); }
+    ITCM_FUNC void CAN1_RX1_IRQHandler() { can::rx_irq(CAN1, CAN_RX_FIFO1); }
+    void CAN1_SCE_IRQHandler() {} // Not used
+
+    void HAL_SPI_MspInit(SPI_HandleTypeDef *spi) { spi::msp_init(spi); }
+    void HAL_SPI_MspDeInit(SPI_HandleTypeDef *spi) { spi::msp_deinit(spi); }
+
+    ITCM_FUNC void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *spi) { spi::done(spi); }
+    void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *spi) { spi::error(spi); }
+
+    void SPI1_IRQHandler() { spi::irq(0); }
+    void SPI3_IRQHandler() { spi::irq(1); }
+    void SPI4_IRQHandler() { spi::irq(2); }
+    void SPI5_IRQHandler() { spi::irq(3); }
+
+    ITCM_FUNC void DMA2_Stream2_IRQHandler() { spi::rx_dma_irq(0); }
+    ITCM_FUNC void DMA2_Stream5_IRQHandler() { spi::tx_dma_irq(0); }
+    ITCM_FUNC void DMA1_Stream2_IRQHandler() { spi::rx_dma_irq(1); }
+    ITCM_FUNC void DMA1_Stream5_IRQHandler() { spi::tx_dma_irq(1); }
+    ITCM_FUNC void DMA2_Stream0_IRQHandler() { spi::rx_dma_irq(2); }
+    ITCM_FUNC void DMA2_Stream1_IRQHandler() { spi::tx_dma_irq(2); }
+    ITCM_FUNC void DMA2_Stream3_IRQHandler() { spi::rx_dma_irq(3); }
+    ITCM_FUNC void DMA2_Stream4_IRQHandler() { spi::tx_dma_irq(3); }
+}
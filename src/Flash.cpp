@@ -1,20 +1,8 @@
 #include "Flash.hpp"
+#include "System.hpp"
 
 #include <stm32f7xx_hal.h>
-
-static size_t SECTOR_OFFSETS[] = {
-/*32kb*/    0x08000000,
-/*32kb*/    0x08000000 + 1*(0x8000), /* 32kb offset */
-/*32kb*/    0x08000000 + 2*(0x8000), /* 64kb offset */
-/*32kb*/    0x08000000 + 3*(0x8000), /* 96kb offset */
-/*128kb*/   0x08000000 + 1*(0x20000),/* 128kb offset */
-/*256kb*/   0x08000000 + 1*(0x40000),/* 256kb offset */
-/*256kb*/   0x08000000 + 2*(0x40000),/* 512kb offset */
-/*256kb*/   0x08000000 + 3*(0x40000),/* 1024kb offset */
-/*256kb*/   0x08000000 + 4*(0x40000),/* 1536kb offset */
-/*256kb*/   0x08000000 + 5*(0x40000),/* 2048kb offset */
-/*256kb*/   0x08000000 + 6*(0x40000) /* 2560kb offset */
-};
+#include <string.h>
 
 static uint32_t SECTOR_INDICES[] = {
     FLASH_SECTOR_0,
@@ -32,6 +20,9 @@ static uint32_t SECTOR_INDICES[] = {
 };
 
 namespace bootloader { namespace flash {
+    static IdleHook s_idleHook = nullptr;
+    static void* s_idleArg = nullptr;
+
     void unlock() {
         HAL_FLASH_Unlock();
     }
@@ -39,6 +30,45 @@ namespace bootloader { namespace flash {
         HAL_FLASH_Lock();
     }
 
+    void set_idle_hook(IdleHook hook, void* arg) {
+        s_idleHook = hook;
+        s_idleArg = arg;
+    }
+
+    static inline void idle() {
+        if (s_idleHook) s_idleHook(s_idleArg);
+    }
+
+    #ifdef BOOTLOADER_ITCM
+    static IdleHook s_busyHook = nullptr;
+    static void* s_busyArg = nullptr;
+
+    void set_busy_hook(IdleHook hook, void* arg) {
+        s_busyHook = hook;
+        s_busyArg = arg;
+    }
+
+    // What HAL_FLASHEx_Erase does for a sector, but started from here (the
+    // end of FLASH_Erase_Sector would stall on the erase) and running the
+    // busy hook while it's busy rather than just polling
+    ITCM_FUNC static int erase_sector(uint32_t sector) {
+        while (__HAL_FLASH_GET_FLAG(FLASH_FLAG_BSY)) {}
+        __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+
+        CLEAR_BIT(FLASH->CR, FLASH_CR_PSIZE | FLASH_CR_SNB);
+        FLASH->CR |= FLASH_PSIZE_WORD | FLASH_CR_SER | (sector << FLASH_CR_SNB_Pos);
+        FLASH->CR |= FLASH_CR_STRT;
+        __DSB();
+
+        while (__HAL_FLASH_GET_FLAG(FLASH_FLAG_BSY)) {
+            if (s_busyHook) s_busyHook(s_busyArg);
+        }
+
+        CLEAR_BIT(FLASH->CR, FLASH_CR_SER | FLASH_CR_SNB);
+        return __HAL_FLASH_GET_FLAG(FLASH_FLAG_ALL_ERRORS) ? -1 : 0;
+    }
+    #endif
+
     int write(uint8_t* ptr, uint32_t data) {
         uint64_t loc = (size_t) ptr;
 
@@ -47,35 +77,79 @@ namespace bootloader { namespace flash {
                                         i + loc, (data >> 8*i) & 0xFF);
             if (ret != HAL_OK) return -1;
         }
+        // Make sure we verify against the flash and not a stale line
+        system::dcache_invalidate(ptr, 4);
         if (*((uint32_t*) ptr) != data) return -1;
         return 0;
     }
 
+    int program(uint8_t* ptr, const uint32_t* words, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            int ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD,
+                                        (size_t) ptr + 4 * i, words[i]);
+            if (ret != HAL_OK) return -1;
+            idle();
+        }
+        // Check the whole burst at once
+        system::dcache_invalidate(ptr, 4 * count);
+        if (memcmp(ptr, words, 4 * count)) return -1;
+        return 0;
+    }
+
+    static bool sector_blank(int idx) {
+        return blank((const uint8_t*) SECTOR_OFFSETS[idx],
+                     SECTOR_OFFSETS[idx + 1] - SECTOR_OFFSETS[idx]);
+    }
+
+    int blank_sectors(const uint8_t* start, size_t length, uint32_t* mask, int* count) {
+        int startIdx, endIdx;
+        *mask = 0;
+        *count = 0;
+        if (length == 0) return 0;
+        if (!sector_range(start, length, &startIdx, &endIdx)) return 1;
+        *count = endIdx - startIdx;
+        for (int i = startIdx; i < endIdx; i++) {
+            if (sector_blank(i)) *mask |= 1U << (i - startIdx);
+        }
+        return 0;
+    }
 
     int erase(uint8_t* start, size_t length) {
-        FLASH_EraseInitTypeDef eraseDef;
-        eraseDef.TypeErase = FLASH_TYPEERASE_SECTORS;
+        if (length == 0) return 0;
 
-        int startIdx = -1;
-        int endIdx = -1;
-        for (int i = 0; i < 11; i++) {
-            if (SECTOR_OFFSETS[i] == (size_t) start) startIdx = i;
-        }
-        for (int i = startIdx; i < 11; i++) {
-            if (SECTOR_OFFSETS[i] >= (size_t) start + length) endIdx = i;
-        }
-        if (startIdx < 0 || endIdx < 0) return 1;
+        // start has to be on a sector boundary, erase
+        // as many sectors as it takes to cover length
+        int startIdx, endIdx;
+        if (!sector_range(start, length, &startIdx, &endIdx)) return 1;
 
-        eraseDef.Sector = SECTOR_INDICES[startIdx];
-        eraseDef.NbSectors = endIdx = startIdx;
+        #ifndef BOOTLOADER_ITCM
+        FLASH_EraseInitTypeDef eraseDef;
+        eraseDef.TypeErase = FLASH_TYPEERASE_SECTORS;
         eraseDef.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+        eraseDef.NbSectors = 1;
+        uint32_t error = 0xFFFFFFFFU; // Faulty sector, if any
+        #endif
 
-
-        uint32_t error = HAL_FLASH_ERROR_NONE;
+        int ret = 0;
+        // Left as it was, another session might be writing
+        bool locked = READ_BIT(FLASH->CR, FLASH_CR_LOCK);
         HAL_FLASH_Unlock();
-        HAL_FLASHEx_Erase(&eraseDef, &error);
-        HAL_FLASH_Lock();
+        // A sector at a time (skipping the ones that are blank
+        // already) so that the idle hook runs in between
+        for (int i = startIdx; i < endIdx && !ret; i++) {
+            if (sector_blank(i)) continue;
+            #ifdef BOOTLOADER_ITCM
+            ret = erase_sector(SECTOR_INDICES[i]);
+            #else
+            eraseDef.Sector = SECTOR_INDICES[i];
+            ret = HAL_FLASHEx_Erase(&eraseDef, &error) != HAL_OK || error != 0xFFFFFFFFU;
+            #endif
+            idle();
+        }
+        if (locked) HAL_FLASH_Lock();
+
+        system::dcache_invalidate(start, SECTOR_OFFSETS[endIdx] - (size_t) start);
 
-        return error != 0xFFFFFFFFU;
+        return ret;
     }
 }}
@@ -0,0 +1,62 @@
+#include "Frame.hpp"
+
+namespace bootloader {
+    namespace uart {
+        ITCM_FUNC uint16_t fletcher16(const uint8_t *data, size_t count, uint16_t prev) {
+            uint16_t sum1 = prev & 0xFF;
+            uint16_t sum2 = prev >> 8;
+
+            for (size_t index = 0; index < count; ++index) {
+                sum1 = (sum1 + data[index]) % 255;
+                sum2 = (sum2 + sum1) % 255;
+            }
+
+            return (sum2 << 8) | sum1;
+        }
+
+        ITCM_FUNC size_t encode(const Msg& m, uint8_t* buf) {
+            const Msg::Packet& p = m.pack();
+            buf[0] = header(m);
+            for (int i = 0; i < 8; i++) buf[1 + i] = p.buffer[i];
+            uint16_t checksum = fletcher16(p.buffer, 8);
+            buf[9] = checksum & 0xFF;
+            buf[10] = checksum >> 8;
+            return FRAME_LEN;
+        }
+
+        ITCM_FUNC FrameParser::Result
+        FrameParser::feed(uint8_t byte, Msg* out) {
+            if (_len == 0) {
+                if (byte != 0x02 && (_resync || byte != 0x03)) {
+                    if (_resync) return MORE; // Still skipping
+                    _resync = true;
+                    out->setError(true);
+                    return BAD;
+                }
+            }
+            _buf[_len++] = byte;
+            if (_len < FRAME_LEN) return MORE;
+            _len = 0;
+
+            uint16_t checksum = _buf[9] | (_buf[10] << 8);
+            if (fletcher16(&_buf[1], 8) != checksum) {
+                // Likely a bit error, so still lined up (or still resyncing)
+                out->setError(true);
+                return BAD;
+            }
+            _resync = false;
+            for (int i = 0; i < 8; i++) out->packet().buffer[i] = _buf[1 + i];
+            out->setError(false);
+            return FRAME;
+        }
+
+        ITCM_FUNC FrameParser::Result
+        FrameParser::fail(Msg* out) {
+            if (_len == 0) return MORE;
+            _len = 0;
+            _resync = true;
+            out->setError(true);
+            return BAD;
+        }
+    }
+}
@@ -0,0 +1,253 @@
+#include "Image.hpp"
+#include "Flash.hpp"
+
+#if !defined(BOOTLOADER_NATIVE)
+#include <stm32f7xx_hal.h>
+#endif
+#include <stddef.h>
+#include <string.h>
+
+namespace bootloader { namespace image {
+    #if defined(BOOTLOADER_NATIVE)
+    uint32_t crc32(const uint8_t* data, size_t len) {
+        uint32_t crc = 0xFFFFFFFF;
+        for (size_t i = 0; i < len; i++) {
+            crc ^= data[i];
+            for (int j = 0; j < 8; j++) {
+                crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+            }
+        }
+        return crc ^ 0xFFFFFFFF;
+    }
+    #else
+    uint32_t crc32(const uint8_t* data, size_t len) {
+        __HAL_RCC_CRC_CLK_ENABLE();
+
+        // Standard polynomial, bit-reversed in (by byte) and out
+        // to match zlib
+        CRC->POL = 0x04C11DB7;
+        CRC->INIT = 0xFFFFFFFF;
+        CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT | CRC_CR_RESET;
+
+        // Byte reversal is per byte, so feed the words big-endian
+        size_t words = len / 4;
+        const uint32_t* w = (const uint32_t*) data;
+        for (size_t i = 0; i < words; i++) {
+            CRC->DR = __REV(w[i]);
+        }
+        for (size_t i = words * 4; i < len; i++) {
+            *((volatile uint8_t*) &CRC->DR) = data[i];
+        }
+        return CRC->DR ^ 0xFFFFFFFF;
+    }
+    #endif
+
+    #if defined(BOOTLOADER_NATIVE)
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    static inline uint32_t rotr(uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void Sha256::start() {
+        static const uint32_t init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(_state, init, sizeof(_state));
+        _len = 0;
+    }
+
+    void Sha256::block(const uint8_t* data) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (data[4 * i] << 24) | (data[4 * i + 1] << 16) |
+                   (data[4 * i + 2] << 8) | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+        uint32_t e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+                          ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        _state[0] += a; _state[1] += b; _state[2] += c; _state[3] += d;
+        _state[4] += e; _state[5] += f; _state[6] += g; _state[7] += h;
+    }
+
+    void Sha256::update(const uint8_t* data, size_t len) {
+        size_t used = _len % 64;
+        _len += len;
+        if (used) {
+            size_t n = len < 64 - used ? len : 64 - used;
+            memcpy(_buf + used, data, n);
+            data += n;
+            len -= n;
+            if (used + n < 64) return;
+            block(_buf);
+        }
+        for (; len >= 64; data += 64, len -= 64) block(data);
+        memcpy(_buf, data, len);
+    }
+
+    void Sha256::finish(uint8_t* digest) {
+        uint64_t bits = _len * 8;
+        uint8_t pad[72] = {0x80};
+        size_t n = (_len % 64 < 56 ? 56 : 120) - _len % 64;
+        for (int i = 0; i < 8; i++) pad[n + i] = bits >> (56 - 8 * i);
+        update(pad, n + 8);
+        for (int i = 0; i < 8; i++) {
+            digest[4 * i] = _state[i] >> 24;
+            digest[4 * i + 1] = _state[i] >> 16;
+            digest[4 * i + 2] = _state[i] >> 8;
+            digest[4 * i + 3] = _state[i];
+        }
+    }
+    #else
+    void Sha256::start() {
+        __HAL_RCC_HASH_CLK_ENABLE();
+
+        // SHA-256 of the bytes in memory order (the unit
+        // swaps the words we feed it)
+        HASH->CR = HASH_CR_ALGO | HASH_CR_DATATYPE_1 | HASH_CR_INIT;
+        _len = 0;
+    }
+
+    void Sha256::update(const uint8_t* data, size_t len) {
+        // The unit holds off the writes while it works on a block
+        size_t words = len / 4;
+        for (size_t i = 0; i < words; i++) {
+            uint32_t w;
+            memcpy(&w, data + 4 * i, 4);
+            HASH->DIN = w;
+        }
+        if (len % 4) {
+            uint32_t w = 0;
+            memcpy(&w, data + 4 * words, len % 4);
+            HASH->DIN = w;
+        }
+        _len += len;
+    }
+
+    void Sha256::finish(uint8_t* digest) {
+        // Valid bits of the last word
+        HASH->STR = 8 * (_len % 4);
+        HASH->STR |= HASH_STR_DCAL;
+        while (!(HASH->SR & HASH_SR_DCIS)) {}
+        for (int i = 0; i < 8; i++) {
+            uint32_t w = __REV(HASH_DIGEST->HR[i]);
+            memcpy(digest + 4 * i, &w, 4);
+        }
+    }
+    #endif
+
+    void sha256(const uint8_t* data, size_t len, uint8_t* digest) {
+        Sha256 sha;
+        sha.start();
+        sha.update(data, len);
+        sha.finish(digest);
+    }
+
+    bool present(const uint8_t* start, size_t regionSize) {
+        const Header* h = header(start);
+        return h->magic == MAGIC && h->size <= regionSize - HEADER_SIZE;
+    }
+
+    bool verified(const uint8_t* start, size_t regionSize) {
+        return present(start, regionSize) && header(start)->verified == VERIFIED;
+    }
+
+    bool verify(uint8_t* start, size_t regionSize) {
+        if (!present(start, regionSize)) return false;
+        if (header(start)->verified == VERIFIED) return true;
+        uint8_t digest[DIGEST_SIZE];
+        sha256(entry(start), header(start)->size, digest);
+        return accept(start, regionSize, digest);
+    }
+
+    bool accept(uint8_t* start, size_t regionSize, const uint8_t* digest) {
+        if (!present(start, regionSize)) return false;
+        const Header* h = header(start);
+        if (h->verified == VERIFIED) return true;
+        if (memcmp(digest, h->digest, DIGEST_SIZE)) return false;
+
+        // Remember for next time
+        flash::unlock();
+        flash::write((uint8_t*) &h->verified, VERIFIED);
+        flash::lock();
+        return true;
+    }
+
+    bool newer(const uint8_t* staged, const uint8_t* app, size_t regionSize) {
+        if (!present(staged, regionSize)) return false;
+        if (!present(app, regionSize)) return true;
+        const Header* s = header(staged);
+        const Header* a = header(app);
+        return s->version > a->version ||
+                (s->version == a->version && s->crc != a->crc);
+    }
+
+    bool install(uint8_t* dst, const uint8_t* src, size_t regionSize) {
+        const Header* h = header(src);
+        if (flash::erase(dst, HEADER_SIZE + h->size)) return false;
+
+        flash::unlock();
+        // A KB at a time, hashing what
+        // actually ended up in dst on the way
+        constexpr size_t CHUNK = 1024;
+        const uint32_t* from = (const uint32_t*) (src + HEADER_SIZE);
+        size_t words = (h->size + 3) / 4;
+        Sha256 sha;
+        sha.start();
+        for (size_t i = 0; i < words; i += CHUNK / 4) {
+            size_t n = words - i < CHUNK / 4 ? words - i : CHUNK / 4;
+            if (flash::program(dst + HEADER_SIZE + 4 * i, from + i, n)) {
+                flash::lock();
+                return false;
+            }
+            size_t len = 4 * (i + n) > h->size ? h->size - 4 * i : 4 * n;
+            sha.update(dst + HEADER_SIZE + 4 * i, len);
+        }
+        uint8_t digest[DIGEST_SIZE];
+        sha.finish(digest);
+
+        // Everything but the verified flag, that one is
+        // for accept() to set
+        const uint32_t* fields = (const uint32_t*) h;
+        for (size_t i = 0; i < sizeof(Header) / 4; i++) {
+            if (i == offsetof(Header, verified) / 4) continue;
+            if (flash::write(dst + 4 * i, fields[i])) {
+                flash::lock();
+                return false;
+            }
+        }
+        flash::lock();
+
+        return accept(dst, regionSize, digest);
+    }
+
+    void discard(uint8_t* start) {
+        if (header(start)->magic != MAGIC) return;
+        flash::unlock();
+        flash::write(start, 0);
+        flash::lock();
+    }
+}}
@@ -0,0 +1,30 @@
+#include "System.hpp"
+
+#include <stm32f7xx_hal.h>
+
+// Kept out of the library, the app has its own
+extern "C" {
+    #ifdef BOOTLOADER_ITCM
+    // Out of flash so that the tick (and the timeouts on it) keep going
+    // while the flash is busy erasing, HAL_IncTick() lives in flash
+    ITCM_FUNC void SysTick_Handler() {
+        uwTick++; // 1 ms ticks
+    }
+
+    ITCM_FUNC uint32_t HAL_GetTick() {
+        return uwTick;
+    }
+    #else
+    void SysTick_Handler() {
+        HAL_IncTick();
+        HAL_SYSTICK_IRQHandler();
+    }
+    #endif
+
+    void HAL_SYSTICK_Callback() {}
+
+    void RCC_IRQHandler() {
+        HAL_RCC_NMI_IRQHandler();
+    }
+    void HAL_RCC_CSSCallback() {}
+}
@@ -0,0 +1,326 @@
+#include "Spi.hpp"
+#include "SpiLink.hpp"
+#include "System.hpp"
+
+#include <stm32f7xx_hal.h>
+
+namespace bootloader {
+    namespace spi {
+        class SpiDriver {
+        public:
+            SpiDriver(SPI_TypeDef* spi, IRQn_Type irq,
+                        DMA_Stream_TypeDef* rxDma, uint32_t rxChannel, IRQn_Type rxIrq,
+                        DMA_Stream_TypeDef* txDma, uint32_t txChannel, IRQn_Type txIrq) :
+                            _open(false), _af(0), _irqn(irq), _rxIrqn(rxIrq), _txIrqn(txIrq),
+                            _handle(SPI_HandleTypeDef()),
+                            _rxDma(DMA_HandleTypeDef()),
+                            _txDma(DMA_HandleTypeDef()) {
+                _handle.Instance = spi;
+                _rxDma.Instance = rxDma;
+                _rxDma.Init.Channel = rxChannel;
+                _txDma.Instance = txDma;
+                _txDma.Init.Channel = txChannel;
+            }
+            SPI_HandleTypeDef* getHandle() { return &_handle; }
+            SPI_TypeDef* instance() const { return _handle.Instance; }
+            DMA_HandleTypeDef* rxDma() { return &_rxDma; }
+            DMA_HandleTypeDef* txDma() { return &_txDma; }
+
+            void open(const Pin& sck, const Pin& miso, const Pin& mosi,
+                        const Pin& nss, uint8_t af) {
+                _sck = sck;
+                _miso = miso;
+                _mosi = mosi;
+                _nss = nss;
+                _af = af;
+
+                _handle.Init.Mode = SPI_MODE_SLAVE;
+                _handle.Init.Direction = SPI_DIRECTION_2LINES;
+                _handle.Init.DataSize = SPI_DATASIZE_8BIT;
+                _handle.Init.CLKPolarity = SPI_POLARITY_LOW;
+                _handle.Init.CLKPhase = SPI_PHASE_1EDGE;
+                _handle.Init.NSS = SPI_NSS_HARD_INPUT;
+                _handle.Init.FirstBit = SPI_FIRSTBIT_MSB;
+                _handle.Init.TIMode = SPI_TIMODE_DISABLE;
+                _handle.Init.CRCCalculation = SPI_CRCCALCULATION_ENABLE;
+                _handle.Init.CRCPolynomial = 7;
+                _handle.Init.CRCLength = SPI_CRC_LENGTH_8BIT;
+                _handle.Init.NSSPMode = SPI_NSS_PULSE_DISABLE;
+
+                if (HAL_SPI_Init(&_handle) != HAL_OK) asm("bkpt 255");
+                _open = true;
+                _start();
+            }
+
+            void close() {
+                if (!_open) return;
+                HAL_SPI_Abort(&_handle);
+                HAL_SPI_DeInit(&_handle);
+                _open = false;
+            }
+
+            bool isOpen() const {
+                return _open;
+            }
+
+            void _mspInit() {
+                _clock(true);
+
+                _sck.init(Pin::Mode::ALT_PUSH_PULL, Pin::Pull::NONE, Pin::Speed::VERY_HIGH, _af);
+                _miso.init(Pin::Mode::ALT_PUSH_PULL, Pin::Pull::NONE, Pin::Speed::VERY_HIGH, _af);
+                _mosi.init(Pin::Mode::ALT_PUSH_PULL, Pin::Pull::NONE, Pin::Speed::VERY_HIGH, _af);
+                _nss.init(Pin::Mode::ALT_PUSH_PULL, Pin::Pull::UP, Pin::Speed::VERY_HIGH, _af);
+
+                _dmaInit(&_rxDma, DMA_PERIPH_TO_MEMORY);
+                _dmaInit(&_txDma, DMA_MEMORY_TO_PERIPH);
+                __HAL_LINKDMA(&_handle, hdmarx, _rxDma);
+                __HAL_LINKDMA(&_handle, hdmatx, _txDma);
+
+                _irqEnable();
+            }
+
+            void _dmaInit(DMA_HandleTypeDef* dma, uint32_t direction) {
+                if ((uint32_t) dma->Instance < (uint32_t) DMA2_Stream0) __HAL_RCC_DMA1_CLK_ENABLE();
+                else __HAL_RCC_DMA2_CLK_ENABLE();
+
+                dma->Init.Direction = direction;
+                dma->Init.PeriphInc = DMA_PINC_DISABLE;
+                dma->Init.MemInc = DMA_MINC_ENABLE;
+                dma->Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+                dma->Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+                dma->Init.Mode = DMA_NORMAL;
+                dma->Init.Priority = DMA_PRIORITY_HIGH;
+                dma->Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+                if (HAL_DMA_Init(dma) != HAL_OK) asm("bkpt 255");
+            }
+
+            void _clock(bool enable) {
+                SPI_TypeDef* s = _handle.Instance;
+                if (s == SPI1) { if (enable) __HAL_RCC_SPI1_CLK_ENABLE(); else __HAL_RCC_SPI1_CLK_DISABLE(); }
+                else if (s == SPI3) { if (enable) __HAL_RCC_SPI3_CLK_ENABLE(); else __HAL_RCC_SPI3_CLK_DISABLE(); }
+                else if (s == SPI4) { if (enable) __HAL_RCC_SPI4_CLK_ENABLE(); else __HAL_RCC_SPI4_CLK_DISABLE(); }
+                else if (s == SPI5) { if (enable) __HAL_RCC_SPI5_CLK_ENABLE(); else __HAL_RCC_SPI5_CLK_DISABLE(); }
+            }
+
+            void _irqEnable() {
+                HAL_NVIC_SetPriority(_irqn, 0, 0);
+                HAL_NVIC_EnableIRQ(_irqn);
+                HAL_NVIC_SetPriority(_rxIrqn, 0, 0);
+                HAL_NVIC_EnableIRQ(_rxIrqn);
+                HAL_NVIC_SetPriority(_txIrqn, 0, 0);
+                HAL_NVIC_EnableIRQ(_txIrqn);
+            }
+            void _irqDisable() {
+                HAL_NVIC_DisableIRQ(_irqn);
+                HAL_NVIC_DisableIRQ(_rxIrqn);
+                HAL_NVIC_DisableIRQ(_txIrqn);
+            }
+            void _mspDeInit() {
+                _irqDisable();
+                HAL_DMA_DeInit(&_rxDma);
+                HAL_DMA_DeInit(&_txDma);
+                _sck.deinit();
+                _miso.deinit();
+                _mosi.deinit();
+                _nss.deinit();
+                _clock(false);
+            }
+
+            // Sets up the next block for the master to clock
+            ITCM_FUNC void _start() {
+                _link.fill(_txBlock);
+                system::dcache_clean(_txBlock, BLOCK_SIZE);
+                system::dcache_invalidate(_rxBlock, BLOCK_SIZE);
+                if (HAL_SPI_TransmitReceive_DMA(&_handle, _txBlock, _rxBlock, BLOCK_SIZE) != HAL_OK) {
+                    _link.dropped();
+                }
+            }
+
+            ITCM_FUNC void _done() {
+                system::dcache_invalidate(_rxBlock, BLOCK_SIZE);
+                _link.take(_rxBlock);
+                _start();
+            }
+
+            // Crc/overrun, the packets in it are lost but
+            // the protocol retransmits those
+            void _error() {
+                HAL_SPI_Abort(&_handle);
+                _link.dropped();
+                _start();
+            }
+
+            bool hasData() const { return _link.hasData(); }
+            const Msg* peek() const { return hasData() ? &_link.front() : nullptr; }
+            void release() { _link.drop(); }
+
+            Msg read() {
+                while (!hasData()) {}
+                return _link.pop();
+            }
+            void write(const Msg& m) {
+                // Waits for the master to clock some out
+                while (!_link.push(m)) {}
+            }
+            void flush() {
+                while (!_link.sent()) {}
+            }
+
+            size_t getReadWindow() const { return _link.readWindow(); }
+            size_t getWriteWindow() const { return _link.writeWindow(); }
+        private:
+            bool _open;
+            Pin _sck;
+            Pin _miso;
+            Pin _mosi;
+            Pin _nss;
+            uint8_t _af;
+            IRQn_Type _irqn;
+            IRQn_Type _rxIrqn;
+            IRQn_Type _txIrqn;
+            SPI_HandleTypeDef _handle;
+            DMA_HandleTypeDef _rxDma;
+            DMA_HandleTypeDef _txDma;
+            Link _link;
+            // Whole cache lines, so the maintenance doesn't touch the neighbours
+            alignas(32) uint8_t _txBlock[(BLOCK_SIZE + 31) & ~31];
+            alignas(32) uint8_t _rxBlock[(BLOCK_SIZE + 31) & ~31];
+        };
+
+        // The SPIs whose dma streams don't clash with the
+        // U(S)ARTs' (SPI2's rx is on USART3's tx stream)
+        static const int NUM_SPIS = 4;
+        static SpiDriver s_drivers[NUM_SPIS] = {
+            SpiDriver(SPI1, SPI1_IRQn, DMA2_Stream2, DMA_CHANNEL_3, DMA2_Stream2_IRQn,
+                                        DMA2_Stream5, DMA_CHANNEL_3, DMA2_Stream5_IRQn),
+            SpiDriver(SPI3, SPI3_IRQn, DMA1_Stream2, DMA_CHANNEL_0, DMA1_Stream2_IRQn,
+                                        DMA1_Stream5, DMA_CHANNEL_0, DMA1_Stream5_IRQn),
+            SpiDriver(SPI4, SPI4_IRQn, DMA2_Stream0, DMA_CHANNEL_4, DMA2_Stream0_IRQn,
+                                        DMA2_Stream1, DMA_CHANNEL_4, DMA2_Stream1_IRQn),
+            SpiDriver(SPI5, SPI5_IRQn, DMA2_Stream3, DMA_CHANNEL_2, DMA2_Stream3_IRQn,
+                                        DMA2_Stream4, DMA_CHANNEL_2, DMA2_Stream4_IRQn)
+        };
+        static int getHandleIdx(SPI_HandleTypeDef* handle) {
+            for (int i = 0; i < NUM_SPIS; i++) {
+                if (s_drivers[i].instance() == handle->Instance) return i;
+            }
+            asm("bkpt 255"); // Not one of ours
+            return 0;
+        }
+
+        // All four pins have to be on the same af
+        struct SpiPins {
+            SPI_TypeDef* spi;
+            Pin sck;
+            Pin miso;
+            Pin mosi;
+            Pin nss;
+            uint8_t af;
+        };
+        static const SpiPins s_pins[] = {
+            {SPI1, pins::PA5, pins::PA6, pins::PA7, pins::PA4, GPIO_AF5_SPI1},
+            {SPI1, pins::PA5, pins::PA6, pins::PA7, pins::PA15, GPIO_AF5_SPI1},
+            {SPI1, pins::PB3, pins::PB4, pins::PB5, pins::PA15, GPIO_AF5_SPI1},
+            {SPI1, pins::PB3, pins::PB4, pins::PB5, pins::PA4, GPIO_AF5_SPI1},
+            {SPI1, pins::PG11, pins::PG9, pins::PD7, pins::PG10, GPIO_AF5_SPI1},
+            {SPI3, pins::PC10, pins::PC11, pins::PC12, pins::PA15, GPIO_AF6_SPI3},
+            {SPI3, pins::PC10, pins::PC11, pins::PC12, pins::PA4, GPIO_AF6_SPI3},
+            {SPI3, pins::PB3, pins::PB4, pins::PB5, pins::PA15, GPIO_AF6_SPI3},
+            {SPI4, pins::PE2, pins::PE5, pins::PE6, pins::PE4, GPIO_AF5_SPI4},
+            {SPI4, pins::PE12, pins::PE13, pins::PE14, pins::PE11, GPIO_AF5_SPI4},
+            {SPI5, pins::PF7, pins::PF8, pins::PF9, pins::PF6, GPIO_AF5_SPI5},
+            {SPI5, pins::PH6, pins::PH7, pins::PF11, pins::PH5, GPIO_AF5_SPI5}
+        };
+
+        // For the handlers in DriverInterrupts.cpp
+        void msp_init(SPI_HandleTypeDef* handle) {
+            s_drivers[getHandleIdx(handle)]._mspInit();
+        }
+        void msp_deinit(SPI_HandleTypeDef* handle) {
+            s_drivers[getHandleIdx(handle)]._mspDeInit();
+        }
+        ITCM_FUNC void done(SPI_HandleTypeDef* handle) {
+            s_drivers[getHandleIdx(handle)]._done();
+        }
+        void error(SPI_HandleTypeDef* handle) {
+            s_drivers[getHandleIdx(handle)]._error();
+        }
+
+        void irq(int n) { HAL_SPI_IRQHandler(s_drivers[n].getHandle()); }
+        ITCM_FUNC void rx_dma_irq(int n) { HAL_DMA_IRQHandler(s_drivers[n].rxDma()); }
+        ITCM_FUNC void tx_dma_irq(int n) { HAL_DMA_IRQHandler(s_drivers[n].txDma()); }
+
+        Spi::Spi() : _idx(-1) {}
+        Spi::Spi(const Pin& sck, const Pin& miso, const Pin& mosi, const Pin& nss) : _idx(-1) {
+            for (const SpiPins& p : s_pins) {
+                if (p.sck != sck || p.miso != miso || p.mosi != mosi || p.nss != nss) continue;
+                for (int i = 0; i < NUM_SPIS; i++) {
+                    if (s_drivers[i].instance() != p.spi || s_drivers[i].isOpen()) continue;
+                    _idx = i;
+                    s_drivers[i].open(sck, miso, mosi, nss, p.af);
+                    return;
+                }
+            }
+        }
+
+        Spi::~Spi() {
+        }
+
+        bool
+        Spi::isOpen() const {
+            if (_idx >= 0) return s_drivers[_idx].isOpen();
+            return false;
+        }
+
+        void
+        Spi::close() {
+            if (_idx >= 0) s_drivers[_idx].close();
+        }
+
+        bool
+        Spi::hasData() const {
+            if (_idx >= 0) return s_drivers[_idx].hasData();
+            return false;
+        }
+
+        size_t
+        Spi::getReadWindow() const {
+            if (_idx >= 0) return s_drivers[_idx].getReadWindow();
+            return 0;
+        }
+
+        size_t
+        Spi::getWriteWindow() const {
+            if (_idx >= 0) return s_drivers[_idx].getWriteWindow();
+            return 0;
+        }
+
+        void
+        Spi::flush() {
+            if (_idx >= 0) s_drivers[_idx].flush();
+        }
+
+        ITCM_FUNC Conn&
+        Spi::operator<<(const Msg& w) {
+            if (_idx >= 0) s_drivers[_idx].write(w);
+            return *this;
+        }
+
+        ITCM_FUNC Conn&
+        Spi::operator>>(Msg& r) {
+            if (_idx >= 0) r = s_drivers[_idx].read();
+            return *this;
+        }
+
+        ITCM_FUNC const Msg*
+        Spi::peek() {
+            if (_idx >= 0) return s_drivers[_idx].peek();
+            return nullptr;
+        }
+
+        ITCM_FUNC void
+        Spi::release() {
+            if (_idx >= 0) s_drivers[_idx].release();
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#include "SpiLink.hpp"
+
+#include <string.h>
+
+namespace bootloader {
+    namespace spi {
+        Link::Link() : _credit(0), _inFlight(0) {}
+
+        ITCM_FUNC void
+        Link::fill(uint8_t* block) {
+            size_t n = _tx.size();
+            if (n > _credit) n = _credit;
+            if (n > BLOCK_PACKETS) n = BLOCK_PACKETS;
+
+            BlockHeader* h = (BlockHeader*) block;
+            h->magic = BLOCK_MAGIC;
+            h->count = n;
+            // Room for at most 255, the rest is free for the block
+            // crossing this one (the other end doesn't know of that yet)
+            size_t free = _rx.free();
+            h->credit = free > 255 ? 255 : free;
+            h->reserved = 0;
+
+            uint8_t* p = block + sizeof(BlockHeader);
+            for (size_t i = 0; i < n; i++) {
+                memcpy(p + 8 * i, _tx.front().pack().buffer, 8);
+                _tx.drop();
+            }
+            _credit -= n;
+            _inFlight = n;
+        }
+
+        ITCM_FUNC bool
+        Link::take(const uint8_t* block) {
+            const BlockHeader* h = (const BlockHeader*) block;
+            if (h->magic != BLOCK_MAGIC || h->count > BLOCK_PACKETS) {
+                dropped();
+                return false;
+            }
+            // Its credit was worked out before it got what we
+            // sent alongside, that is taken from it by now
+            _credit = h->credit > _inFlight ? h->credit - _inFlight : 0;
+
+            const uint8_t* p = block + sizeof(BlockHeader);
+            for (size_t i = 0; i < h->count; i++) {
+                Msg* m = _rx.reserve();
+                if (!m) return false; // It overran our credit
+                memcpy(m->packet().buffer, p + 8 * i, 8);
+                m->setError(false);
+                _rx.commit();
+            }
+            return true;
+        }
+
+        void
+        Link::dropped() {
+            _credit = 0;
+        }
+    }
+}
@@ -1,6 +1,15 @@
 #include "System.hpp"
 
 #include <stm32f7xx_hal.h>
+#include <string.h>
+
+#ifdef BOOTLOADER_ITCM
+// From the linker script
+extern "C" uint32_t _sitcm, _eitcm, _siitcm;
+// The vector table in ram, reading it from flash would stall
+// the interrupts during an erase
+alignas(512) static uint32_t s_vectors[128];
+#endif
 
 namespace bootloader { namespace system {
     void partial_init() {
@@ -79,6 +88,22 @@ namespace bootloader { namespace system {
         HAL_NVIC_SetPriority(SysTick_IRQn, 0, 0);
 
 		SCB_EnableICache();
+		#ifdef BOOTLOADER_DCACHE
+		SCB_EnableDCache();
+		#endif
+
+		#ifdef BOOTLOADER_ITCM
+		// Copy the hot code into ITCM RAM
+		memcpy(&_sitcm, &_siitcm, (&_eitcm - &_sitcm) * sizeof(uint32_t));
+		memcpy(s_vectors, (const void*) SCB->VTOR, sizeof(s_vectors));
+		SCB->VTOR = (uint32_t) s_vectors;
+		__DSB();
+		__ISB();
+		#endif
+
+		#ifdef FRAME_TIMING
+		start_cycle_counter();
+		#endif
 
 		__GPIOA_CLK_ENABLE();
 		__GPIOB_CLK_ENABLE();
@@ -128,11 +153,17 @@ namespace bootloader { namespace system {
         HAL_RCC_DeInit();
         HAL_DeInit();
     }
+    void reset() {
+        NVIC_SystemReset();
+    }
     void run(void* app) {
-        uint32_t* addr = (uint32_t*) app;
         if(CONTROL_nPRIV_Msk & __get_CONTROL( )) {}
 
         deinit();
+        jump(app);
+    }
+    void jump(void* app) {
+        uint32_t* addr = (uint32_t*) app;
 
         //Load the vector table address of the user application into SCB->VTOR register
         SCB->VTOR = ( uint32_t )addr;
@@ -144,17 +175,47 @@ namespace bootloader { namespace system {
         ( ( void ( * )( void ) )addr[1] )( ) ;
     }
 
-    extern "C" {
-        void SysTick_Handler() {
-            HAL_IncTick();
-            HAL_SYSTICK_IRQHandler();
-        }
+    uint32_t read_backup(int reg) {
+        return (&RTC->BKP0R)[reg];
+    }
+    void write_backup(int reg, uint32_t val) {
+        // The PWR clock is needed to unlock the backup domain
+        __HAL_RCC_PWR_CLK_ENABLE();
+        SET_BIT(PWR->CR1, PWR_CR1_DBP);
+        (&RTC->BKP0R)[reg] = val;
+        CLEAR_BIT(PWR->CR1, PWR_CR1_DBP);
+    }
 
-        void HAL_SYSTICK_Callback() {}
+    // Cache maintenance works on whole 32 byte lines
+    static inline uint32_t* line_start(const void* addr) {
+        return (uint32_t*) ((uint32_t) addr & ~0x1F);
+    }
+    static inline int32_t line_len(const void* addr, size_t len) {
+        return (int32_t) (((uint32_t) addr & 0x1F) + len + 0x1F) & ~0x1F;
+    }
 
-        void RCC_IRQHandler() {
-            HAL_RCC_NMI_IRQHandler();
-        }
-        void HAL_RCC_CSSCallback() {}
+    void dcache_clean(const void* addr, size_t len) {
+        #ifdef BOOTLOADER_DCACHE
+        SCB_CleanDCache_by_Addr(line_start(addr), line_len(addr, len));
+        #endif
+    }
+    void dcache_invalidate(const void* addr, size_t len) {
+        #ifdef BOOTLOADER_DCACHE
+        SCB_InvalidateDCache_by_Addr(line_start(addr), line_len(addr, len));
+        #endif
+    }
+
+    uint32_t millis() {
+        return HAL_GetTick();
+    }
+
+    void start_cycle_counter() {
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->LAR = 0xC5ACCE55; // Unlock the DWT on the M7
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+    uint32_t cycle_count() {
+        return DWT->CYCCNT;
     }
 }}
@@ -1,32 +1,59 @@
 #include "Uart.hpp"
+#include "Frame.hpp"
 #include "Buffer.hpp"
+#include "System.hpp"
 
 #include <stm32f7xx_hal.h>
 #include <string.h>
 
-#define USE_CHECKSUM
+#ifndef UART_PORTS
+#define UART_PORTS 2
+#endif
 
 namespace bootloader{
     namespace uart {
+        // The rx/tx rings, only for the ports that get opened (UART_PORTS
+        // of them, set it to open more, up to all eight, at once)
+        struct Rings {
+            Buffer<uint8_t, 8192> rx;
+            Buffer<uint8_t, 8192> tx;
+        };
+        static Rings s_rings[UART_PORTS];
+        static int s_ringsUsed = 0;
+
         class UartDriver {
         public:
-            UartDriver(USART_TypeDef* uart) : _open(false),
+            UartDriver(USART_TypeDef* uart, IRQn_Type irq, DMA_Stream_TypeDef* txDma,
+                        uint32_t txDmaChannel) : _open(false),
                            _rxPin(),
                            _txPin(),
+                           _rxAf(0),
+                           _txAf(0),
+                           _irqn(irq),
                            _handle(UART_HandleTypeDef()),
-                           _rxBuffer(),
-                           _txBuffer(),
+                           _txDma(DMA_HandleTypeDef()),
+                           _rings(nullptr),
                            _transmitting(false),
-                           _error(false) {
+                           _error(false),
+                           _fallbackBaud(0),
+                           _baudStart(0) {
                 _handle.Instance = uart;
+                _txDma.Instance = txDma;
+                _txDma.Init.Channel = txDmaChannel;
             }
             UART_HandleTypeDef* getHandle() { return &_handle; }
+            USART_TypeDef* instance() const { return _handle.Instance; }
 
-            void open(const Pin& rx, const Pin& tx, int baud) {
+            void open(const Pin& rx, const Pin& tx, int baud, uint8_t rxAf, uint8_t txAf,
+                        Rings* rings) {
+                _rings = rings;
                 _rxPin = rx;
                 _txPin = tx;
+                _rxAf = rxAf;
+                _txAf = txAf;
 
                 _handle.Init.BaudRate   = baud;
+                _handle.Init.OverSampling = _oversampling(baud);
                 _handle.Init.WordLength = UART_WORDLENGTH_8B;
                 _handle.Init.StopBits   = UART_STOPBITS_1;
                 _handle.Init.Parity     = UART_PARITY_NONE;
@@ -47,13 +74,14 @@ namespace bootloader{
             }
 
             void _mspInit() {
-                __USART3_CLK_ENABLE();
+                _clock(true);
 
                 _txPin.init(Pin::Mode::ALT_PUSH_PULL, Pin::Pull::NONE, Pin::Speed::VERY_HIGH,
-                                GPIO_AF7_USART3);
+                                _txAf);
                 _rxPin.init(Pin::Mode::ALT_OPEN_DRAIN, Pin::Pull::NONE, Pin::Speed::VERY_HIGH,
-                                GPIO_AF7_USART3);
+                                _rxAf);
 
+                _dmaInit();
                 _irqEnable();
 
                 // Start read
@@ -61,22 +89,100 @@ namespace bootloader{
                 SET_BIT(_handle.Instance->CR1, USART_CR1_PEIE | USART_CR1_RXNEIE);
             }
 
-            void _irqEnable() {
-                if (_handle.Instance == USART3) {
-                    HAL_NVIC_SetPriority(USART3_IRQn,0,0);
-                    HAL_NVIC_EnableIRQ(USART3_IRQn);
+            void _dmaInit() {
+                if ((uint32_t) _txDma.Instance < (uint32_t) DMA2_Stream0) __HAL_RCC_DMA1_CLK_ENABLE();
+                else __HAL_RCC_DMA2_CLK_ENABLE();
+
+                _txDma.Init.Direction = DMA_MEMORY_TO_PERIPH;
+                _txDma.Init.PeriphInc = DMA_PINC_DISABLE;
+                _txDma.Init.MemInc = DMA_MINC_ENABLE;
+                _txDma.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+                _txDma.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+                _txDma.Init.Mode = DMA_NORMAL;
+                _txDma.Init.Priority = DMA_PRIORITY_LOW;
+                _txDma.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+                if (HAL_DMA_Init(&_txDma) != HAL_OK) asm("bkpt 255");
+            }
+
+            // The kernel clock (PCLK, the reset default)
+            uint32_t _pclk() const {
+                USART_TypeDef* u = _handle.Instance;
+                return u == USART1 || u == USART6 ? HAL_RCC_GetPCLK2Freq() : HAL_RCC_GetPCLK1Freq();
+            }
+            uint32_t _oversampling(uint32_t baud) const {
+                return baud > _pclk() / 16 ? UART_OVERSAMPLING_8 : UART_OVERSAMPLING_16;
+            }
+
+            bool baudValid(uint32_t baud) const {
+                uint32_t clk = _pclk();
+                if (baud == 0 || baud > clk / 8) return false;
+                // BRR divides 2x the clock when oversampling by 8
+                uint32_t scaled = _oversampling(baud) == UART_OVERSAMPLING_8 ? 2 * clk : clk;
+                uint32_t div = (scaled + baud / 2) / baud;
+                uint32_t actual = scaled / div;
+                uint32_t err = actual > baud ? actual - baud : baud - actual;
+                return err * 50 <= baud;
+            }
+
+            void setBaud(uint32_t baud) {
+                flush();
+                _fallbackBaud = _handle.Init.BaudRate;
+                _baudStart = HAL_GetTick();
+                _reconfigure(baud);
+            }
+            // A good frame came in, keep the rate
+            ITCM_FUNC void confirmBaud() {
+                _fallbackBaud = 0;
+            }
+            // Falling back re-inits through the hal, which is in flash, so
+            // that waits for an erase to finish. The rest of the forwarding
+            // path (from here down) is in ITCM with BOOTLOADER_ITCM
+            ITCM_FUNC void checkBaud() {
+                if (_fallbackBaud && HAL_GetTick() - _baudStart >= Msg::BAUD_FALLBACK_MS) {
+                    _reconfigure(_fallbackBaud);
+                    _fallbackBaud = 0;
                 }
             }
+            void _reconfigure(uint32_t baud) {
+                _handle.Init.BaudRate = baud;
+                _handle.Init.OverSampling = _oversampling(baud);
+                // Already initialized so this leaves the msp
+                // and the interrupt enables alone
+                if (HAL_UART_Init(&_handle) != HAL_OK) asm("bkpt 255");
+                // Whatever came in during the switch is junk,
+                // resync on the host's next STATUS
+                _rings->rx.clear();
+                _error = false;
+                _parser.resync();
+            }
+
+            void _clock(bool enable) {
+                USART_TypeDef* u = _handle.Instance;
+                if (u == USART1) { if (enable) __HAL_RCC_USART1_CLK_ENABLE(); else __HAL_RCC_USART1_CLK_DISABLE(); }
+                else if (u == USART2) { if (enable) __HAL_RCC_USART2_CLK_ENABLE(); else __HAL_RCC_USART2_CLK_DISABLE(); }
+                else if (u == USART3) { if (enable) __HAL_RCC_USART3_CLK_ENABLE(); else __HAL_RCC_USART3_CLK_DISABLE(); }
+                else if (u == UART4) { if (enable) __HAL_RCC_UART4_CLK_ENABLE(); else __HAL_RCC_UART4_CLK_DISABLE(); }
+                else if (u == UART5) { if (enable) __HAL_RCC_UART5_CLK_ENABLE(); else __HAL_RCC_UART5_CLK_DISABLE(); }
+                else if (u == USART6) { if (enable) __HAL_RCC_USART6_CLK_ENABLE(); else __HAL_RCC_USART6_CLK_DISABLE(); }
+                else if (u == UART7) { if (enable) __HAL_RCC_UART7_CLK_ENABLE(); else __HAL_RCC_UART7_CLK_DISABLE(); }
+                else if (u == UART8) { if (enable) __HAL_RCC_UART8_CLK_ENABLE(); else __HAL_RCC_UART8_CLK_DISABLE(); }
+            }
+
+            void _irqEnable() {
+                HAL_NVIC_SetPriority(_irqn,0,0);
+                HAL_NVIC_EnableIRQ(_irqn);
+            }
             void _irqDisable() {
-                if (_handle.Instance == USART3) {
-                    HAL_NVIC_DisableIRQ(USART3_IRQn);
-                }
+                HAL_NVIC_DisableIRQ(_irqn);
             }
             void _mspDeInit() {
-                __USART3_CLK_DISABLE();
+                _irqDisable();
+                _txPin.deinit();
+                _rxPin.deinit();
+                _clock(false);
             }
 
-            void _irq() {
+            ITCM_FUNC void _irq() {
                 uint32_t isrflags   = READ_REG(_handle.Instance->ISR);
                 uint32_t cr1its     = READ_REG(_handle.Instance->CR1);
                 uint32_t cr3its     = READ_REG(_handle.Instance->CR3);
@@ -134,36 +240,36 @@ namespace bootloader{
                 }
             }
 
-            void _txIRQ() {
-                if (_txBuffer.empty()) {
+            ITCM_FUNC void _txIRQ() {
+                if (_rings->tx.empty()) {
                     // Unset the transmit bit
                     CLEAR_BIT(_handle.Instance->CR1, USART_CR1_TXEIE);
                     // Set transmission complete
                     SET_BIT(_handle.Instance->CR1, USART_CR1_TCIE);
                 } else {
-                    uint8_t val = _txBuffer.pop();
+                    uint8_t val = _rings->tx.pop();
                     // Set transmission register
                     _handle.Instance->TDR = val;
                 }
             }
 
-            void _txCpltIRQ() {
+            ITCM_FUNC void _txCpltIRQ() {
                 // Transmission complete! Unset transmission complete and transmit
                 // handles
                 CLEAR_BIT(_handle.Instance->CR1, (USART_CR1_TXEIE | USART_CR1_TCIE));
                 _transmitting = false;
             }
 
-            void _rxIRQ() {
+            ITCM_FUNC void _rxIRQ() {
                 uint8_t data = (_handle.Instance->RDR);
-                if (!_rxBuffer.push(data)) {
+                if (!_rings->rx.push(data)) {
                     // If full
                     _error = true;
                     resetReading();
                 }
             }
 
-            void _transmit() {
+            ITCM_FUNC void _transmit() {
                 if (!_transmitting) {
                     _transmitting = true;
                     // Set the send bit, will cause an interrupt to do the actual sending
@@ -172,25 +278,37 @@ namespace bootloader{
                 }
             }
 
-            bool hasData() const {
-                return !_rxBuffer.empty() || _error;
+            ITCM_FUNC bool hasData() const {
+                return !_rings->rx.empty() || _error;
             }
 
-            void write(uint8_t* msg, size_t len) {
+            ITCM_FUNC void write(uint8_t* msg, size_t len) {
                 // Wait until there is enough space
-                while (_txBuffer.free() < len) {
+                while (_rings->tx.free() < len) {
                     if (!_transmitting) _transmit();
                 }
                 // Copy to buffer
-                for (size_t i = 0; i < len; i++) _txBuffer.push(msg[i]);
+                for (size_t i = 0; i < len; i++) _rings->tx.push(msg[i]);
                 // Make sure the transmit bit is set
                 // Won't do anything if it isn't
                 if (!_transmitting) _transmit();
             }
 
+            // Sends straight out of memory (flash) by dma, blocks until done
+            void writeDma(const uint8_t* data, size_t len) {
+                // Anything already queued goes first
+                flush();
+                system::dcache_clean(data, len);
+                HAL_DMA_Start(&_txDma, (uint32_t) data, (uint32_t) &_handle.Instance->TDR, len);
+                SET_BIT(_handle.Instance->CR3, USART_CR3_DMAT);
+                HAL_DMA_PollForTransfer(&_txDma, HAL_DMA_FULL_TRANSFER, HAL_MAX_DELAY);
+                CLEAR_BIT(_handle.Instance->CR3, USART_CR3_DMAT);
+                while (!(_handle.Instance->ISR & USART_ISR_TC)) {}
+            }
+
             void resetReading() {
                 __HAL_UART_SEND_REQ(&_handle, UART_RXDATA_FLUSH_REQUEST);
-                _rxBuffer.clear();
+                _rings->rx.clear();
                 // Error, cancel the read to clear things up
                 CLEAR_BIT(_handle.Instance->CR1, (USART_CR1_RXNEIE | USART_CR1_PEIE));
                 CLEAR_BIT(_handle.Instance->CR3, USART_CR3_EIE);
@@ -200,102 +318,164 @@ namespace bootloader{
                 while (_transmitting) {}
             }
 
-            int read(uint8_t* msg, size_t len) {
-                size_t remaining = len;
-                while (remaining > 0) {
-                    uint32_t tickstart = HAL_GetTick(); // For timeout
-                    while (!hasData()) {
-                        if (remaining < len &&
-                            HAL_GetTick() - tickstart >= 10) {
-                            _error = true; // Timeout
-                        }
+            // A byte, -1 on an error (or after 10 ms without one if timeout)
+            ITCM_FUNC int read(uint8_t* byte, bool timeout) {
+                uint32_t tickstart = HAL_GetTick();
+                while (!hasData()) {
+                    if (timeout && HAL_GetTick() - tickstart >= 10) {
+                        _error = true;
                     }
-                    if (_error) {
-                        _error = false;
-                        // Restart reading if need be
-                        SET_BIT(_handle.Instance->CR3, USART_CR3_EIE);
-                        SET_BIT(_handle.Instance->CR1, USART_CR1_PEIE | USART_CR1_RXNEIE);
-                        return -1;
-                    }
-                    msg[len - remaining] = _rxBuffer.pop();
-                    remaining--;
                 }
+                if (_error) {
+                    _error = false;
+                    // Restart reading if need be
+                    SET_BIT(_handle.Instance->CR3, USART_CR3_EIE);
+                    SET_BIT(_handle.Instance->CR1, USART_CR1_PEIE | USART_CR1_RXNEIE);
+                    return -1;
+                }
+                *byte = _rings->rx.pop();
                 return 0;
             }
 
+            // In whole frames, like the other conns
             size_t getReadWindow() const {
-                return _rxBuffer.free();
+                return _rings->rx.free() / FRAME_LEN;
             }
 
-            size_t getWriteWindow() const {
-                return _txBuffer.free();
+            ITCM_FUNC size_t getWriteWindow() const {
+                return _rings->tx.free() / FRAME_LEN;
             }
 
-            bool hadPartialRead() const {
-                return _hadPartialRead;
-            }
-            void setPartialRead(bool partial) {
-                _hadPartialRead = partial;
+            ITCM_FUNC FrameParser& parser() {
+                return _parser;
             }
 
         private:
             bool _open;
             Pin  _rxPin;
             Pin  _txPin;
+            uint8_t _rxAf;
+            uint8_t _txAf;
+            IRQn_Type _irqn;
             UART_HandleTypeDef    _handle;
-            Buffer<uint8_t, 8192> _rxBuffer;
-            Buffer<uint8_t, 8192> _txBuffer;
+            DMA_HandleTypeDef     _txDma;
+            Rings* _rings; // From s_rings once open
             bool _transmitting;
             bool _error;
-            bool _hadPartialRead;
+            FrameParser _parser;
+            uint32_t _fallbackBaud; // Rate to go back to, 0 once confirmed
+            uint32_t _baudStart;
         };
 
-        static UartDriver s_drivers[3] = { UartDriver(USART1), UartDriver(USART2), UartDriver(USART3) };
+        // Every U(S)ART on the F777 with its irq and tx dma stream/channel
+        static const int NUM_UARTS = 8;
+        static UartDriver s_drivers[NUM_UARTS] = {
+            UartDriver(USART1, USART1_IRQn, DMA2_Stream7, DMA_CHANNEL_4),
+            UartDriver(USART2, USART2_IRQn, DMA1_Stream6, DMA_CHANNEL_4),
+            UartDriver(USART3, USART3_IRQn, DMA1_Stream3, DMA_CHANNEL_4),
+            UartDriver(UART4,  UART4_IRQn,  DMA1_Stream4, DMA_CHANNEL_4),
+            UartDriver(UART5,  UART5_IRQn,  DMA1_Stream7, DMA_CHANNEL_4),
+            UartDriver(USART6, USART6_IRQn, DMA2_Stream6, DMA_CHANNEL_5),
+            UartDriver(UART7,  UART7_IRQn,  DMA1_Stream1, DMA_CHANNEL_5),
+            UartDriver(UART8,  UART8_IRQn,  DMA1_Stream0, DMA_CHANNEL_5)
+        };
         static int getUartIdx(USART_TypeDef* def) {
-            if (def == USART3) return 2;
-            else return 1;
+            for (int i = 0; i < NUM_UARTS; i++) {
+                if (s_drivers[i].instance() == def) return i;
+            }
+            asm("bkpt 255"); // Not one of ours
+            return 0;
         }
         static int getHandleIdx(UART_HandleTypeDef* handle) {
-            if (handle->Instance == USART3) return 2;
-            else return 1;
+            return getUartIdx(handle->Instance);
         }
 
-        extern "C" {
-            void HAL_UART_MspInit(UART_HandleTypeDef *uart) {
-                s_drivers[getHandleIdx(uart)]._mspInit();
-            }
+        // Pin alternate functions, where a pin works for more
+        // than one instance the first one listed is used
+        struct UartPin {
+            USART_TypeDef* uart;
+            Pin pin;
+            uint8_t af;
+        };
+        static const UartPin s_rxPins[] = {
+            {USART1, pins::PA10, GPIO_AF7_USART1}, {USART1, pins::PB7, GPIO_AF7_USART1},
+            {USART1, pins::PB15, GPIO_AF4_USART1},
+            {USART2, pins::PA3, GPIO_AF7_USART2}, {USART2, pins::PD6, GPIO_AF7_USART2},
+            {USART3, pins::PB11, GPIO_AF7_USART3}, {USART3, pins::PC11, GPIO_AF7_USART3},
+            {USART3, pins::PD9, GPIO_AF7_USART3},
+            {UART4, pins::PA1, GPIO_AF8_UART4}, {UART4, pins::PC11, GPIO_AF8_UART4},
+            {UART4, pins::PA11, GPIO_AF6_UART4}, {UART4, pins::PD0, GPIO_AF8_UART4},
+            {UART4, pins::PH14, GPIO_AF8_UART4}, {UART4, pins::PI9, GPIO_AF8_UART4},
+            {UART5, pins::PD2, GPIO_AF8_UART5}, {UART5, pins::PB5, GPIO_AF1_UART5},
+            {UART5, pins::PB8, GPIO_AF7_UART5}, {UART5, pins::PB12, GPIO_AF8_UART5},
+            {USART6, pins::PC7, GPIO_AF8_USART6}, {USART6, pins::PG9, GPIO_AF8_USART6},
+            {UART7, pins::PE7, GPIO_AF8_UART7}, {UART7, pins::PF6, GPIO_AF8_UART7},
+            {UART7, pins::PA8, GPIO_AF12_UART7}, {UART7, pins::PB3, GPIO_AF12_UART7},
+            {UART8, pins::PE0, GPIO_AF8_UART8}
+        };
+        static const UartPin s_txPins[] = {
+            {USART1, pins::PA9, GPIO_AF7_USART1}, {USART1, pins::PB6, GPIO_AF7_USART1},
+            {USART1, pins::PB14, GPIO_AF4_USART1},
+            {USART2, pins::PA2, GPIO_AF7_USART2}, {USART2, pins::PD5, GPIO_AF7_USART2},
+            {USART3, pins::PB10, GPIO_AF7_USART3}, {USART3, pins::PC10, GPIO_AF7_USART3},
+            {USART3, pins::PD8, GPIO_AF7_USART3},
+            {UART4, pins::PA0, GPIO_AF8_UART4}, {UART4, pins::PC10, GPIO_AF8_UART4},
+            {UART4, pins::PA12, GPIO_AF6_UART4}, {UART4, pins::PD1, GPIO_AF8_UART4},
+            {UART4, pins::PH13, GPIO_AF8_UART4},
+            {UART5, pins::PC12, GPIO_AF8_UART5}, {UART5, pins::PB6, GPIO_AF1_UART5},
+            {UART5, pins::PB9, GPIO_AF7_UART5}, {UART5, pins::PB13, GPIO_AF8_UART5},
+            {USART6, pins::PC6, GPIO_AF8_USART6}, {USART6, pins::PG14, GPIO_AF8_USART6},
+            {UART7, pins::PE8, GPIO_AF8_UART7}, {UART7, pins::PF7, GPIO_AF8_UART7},
+            {UART7, pins::PA15, GPIO_AF12_UART7}, {UART7, pins::PB4, GPIO_AF12_UART7},
+            {UART8, pins::PE1, GPIO_AF8_UART8}
+        };
 
-            void HAL_UART_MspDeInit(UART_HandleTypeDef *uart) {
-                s_drivers[getHandleIdx(uart)]._mspInit();
+        // Whether p can be used by uart (NC always can), and with which af
+        template<size_t N>
+        static bool findPin(const UartPin (&table)[N], USART_TypeDef* uart,
+                                const Pin& p, uint8_t* af) {
+            *af = 0;
+            if (p == pins::NC) return true;
+            for (size_t i = 0; i < N; i++) {
+                if (table[i].uart == uart && table[i].pin == p) {
+                    *af = table[i].af;
+                    return true;
+                }
             }
+            return false;
+        }
 
-            void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart) {}
-            void HAL_UART_TxHalfCpltCallback(UART_HandleTypeDef *huart) {}
-            void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {}
+        // For the handlers in DriverInterrupts.cpp
+        void msp_init(UART_HandleTypeDef* handle) {
+            s_drivers[getHandleIdx(handle)]._mspInit();
+        }
 
-            // Interrupts
-            void USART3_IRQHandler() {
-                s_drivers[getUartIdx(USART3)]._irq();
-            }
+        void msp_deinit(UART_HandleTypeDef* handle) {
+            s_drivers[getHandleIdx(handle)]._mspDeInit();
+        }
+
+        ITCM_FUNC void irq(int n) {
+            s_drivers[n]._irq();
         }
 
         Uart::Uart() : _idx(-1) {}
         Uart::Uart(const Pin& rx, const Pin& tx, int baud) : _idx(-1) {
             if (!rx.isValid() && !tx.isValid()) return;
-            if ((rx == pins::NC || rx == pins::PA10 || rx == pins::PB7 || rx == pins::PB15) &&
-                (tx == pins::NC || tx == pins::PA9 || tx == pins::PB6 || tx == pins::PB14)) {
-                _idx = getUartIdx(USART1);
-            }
-            if ((rx == pins::NC || rx == pins::PD6 || rx == pins::PA3) &&
-                (tx == pins::NC || tx == pins::PD5 || tx == pins::PA2)) {
-                _idx = getUartIdx(USART2);
-            }
-            if ((rx == pins::NC || rx == pins::PD9 || rx == pins::PB11 || rx == pins::PC11) &&
-                (tx == pins::NC || tx == pins::PD8 || tx == pins::PB10 || tx == pins::PC10)) {
-                _idx = getUartIdx(USART3);
+            if (s_ringsUsed == UART_PORTS) {
+                asm("bkpt 255"); // More ports than UART_PORTS
+                return;
+            }
+            // First free instance both pins work with
+            for (int i = 0; i < NUM_UARTS; i++) {
+                uint8_t rxAf, txAf;
+                if (s_drivers[i].isOpen()) continue;
+                if (findPin(s_rxPins, s_drivers[i].instance(), rx, &rxAf) &&
+                        findPin(s_txPins, s_drivers[i].instance(), tx, &txAf)) {
+                    _idx = i;
+                    s_drivers[i].open(rx, tx, baud, rxAf, txAf, &s_rings[s_ringsUsed++]);
+                    break;
+                }
             }
-
-            if (_idx >= 0) s_drivers[_idx].open(rx, tx, baud);
         }
 
         Uart::~Uart() {
@@ -312,9 +492,12 @@ namespace bootloader{
             if (_idx >= 0) return s_drivers[_idx].close();
         }
 
-        bool
+        ITCM_FUNC bool
         Uart::hasData() const {
-            if (_idx >= 0) return s_drivers[_idx].hasData();
+            if (_idx >= 0) {
+                s_drivers[_idx].checkBaud();
+                return s_drivers[_idx].hasData();
+            }
             return false;
         }
 
@@ -326,7 +509,7 @@ namespace bootloader{
             return 0;
         }
 
-        size_t
+        ITCM_FUNC size_t
         Uart::getWriteWindow() const {
             if (_idx >= 0) {
                 return s_drivers[_idx].getWriteWindow();
@@ -341,121 +524,65 @@ namespace bootloader{
             }
         }
 
-uint16_t fletcher16(uint8_t *data, size_t count) {
-   uint16_t sum1 = 0;
-   uint16_t sum2 = 0;
-   size_t index;
-
-   for( index = 0; index < count; ++index ) {
-      sum1 = (sum1 + data[index]) % 255; // Original
-      //sum1 = (sum1 + index | data[index]) % 255; // The "fix"
-      sum2 = (sum2 + sum1) % 255;
-   }
-
-   return (sum2 << 8) | sum1;
-}
-
-        Conn&
+        ITCM_FUNC Conn&
         Uart::operator<<(const Msg& w) {
-            Msg::Packet p = w.pack();
             if (_idx >= 0) {
-                #ifdef USE_CHECKSUM
-                uint8_t buf[11];
-                #else
-                uint8_t buf[9];
-                #endif
-                uint8_t header = w.getType() == Msg::STATUS ||
-                                 w.getType() == Msg::ACK ? 0x02 : 0x03;
-                buf[0] = header;
-                buf[1] = p.buffer[0]; buf[2] = p.buffer[1];
-                buf[3] = p.buffer[2]; buf[4] = p.buffer[3];
-                buf[5] = p.buffer[4]; buf[6] = p.buffer[5];
-                buf[7] = p.buffer[6]; buf[8] = p.buffer[7];
-                #ifdef USE_CHECKSUM
-                uint8_t checksum = fletcher16(&buf[1], 8);
-                buf[9] = checksum & 0xFF;
-                buf[10] = (checksum >> 8) & 0xFF;
-                #endif
-                s_drivers[_idx].write((uint8_t*) buf, sizeof(buf));
-                //s_drivers[_idx].flush();
+                uint8_t buf[FRAME_LEN];
+                s_drivers[_idx].write(buf, encode(w, buf));
             }
             return *this;
         }
 
-        Conn&
-        Uart::operator>>(Msg& r) {
-            Msg::Packet p;
-            if (_idx >= 0) {
-                r.setError(false);
-
-                uint8_t header; // header
-                uint16_t checksum; // fletcher16
-                if (s_drivers[_idx].hadPartialRead()) {
-                    while (header != 0x02) { // read until next (hopefully) transmission control
-                        if (s_drivers[_idx].read((uint8_t*) &header, 1)) {
-                            s_drivers[_idx].setPartialRead(true);
-                            r.setError(true);
-                            return *this;
-                        }
-                    }
-                    
-                    if (s_drivers[_idx].read((uint8_t*) p.buffer, sizeof(p.buffer))) {
-                        s_drivers[_idx].setPartialRead(true);
-                        r.setError(true);
-                        return *this;
-                    }
-
-                    #ifdef USE_CHECKSUM
-                    if (s_drivers[_idx].read((uint8_t*) &checksum, 2)) {
-                        s_drivers[_idx].setPartialRead(true);
-                        r.setError(true);
-                        return *this;
-                    }
+        bool
+        Uart::baudValid(uint32_t baud) const {
+            if (_idx >= 0) return s_drivers[_idx].baudValid(baud);
+            return false;
+        }
 
-                    uint16_t expected = fletcher16((uint8_t*) &p.buffer, sizeof(p.buffer));
-                    if (checksum != expected) {
-                        s_drivers[_idx].setPartialRead(true);
-                        r.setError(true);
-                        return *this;
-                    }
-                    #endif
+        void
+        Uart::setBaud(uint32_t baud) {
+            if (_idx >= 0) s_drivers[_idx].setBaud(baud);
+        }
 
-                    s_drivers[_idx].setPartialRead(false);
-                } else {
-                    if (s_drivers[_idx].read((uint8_t*) &header, 1)) {
-                        s_drivers[_idx].setPartialRead(true);
-                        r.setError(true);
-                        return *this;
-                    }
-                    if (header != 0x02 && header != 0x03) {
-                        s_drivers[_idx].setPartialRead(true);
-                        r.setError(true);
-                        return *this;
-                    }
-                    if (s_drivers[_idx].read((uint8_t*) p.buffer, sizeof(p.buffer))) {
-                        s_drivers[_idx].setPartialRead(true);
-                        r.setError(true);
-                        return *this;
-                    }
+        void
+        Uart::writeBulk(board_id id, const uint8_t* data, size_t len) {
+            if (_idx < 0) return;
+            while (len > 0) {
+                size_t n = len < BULK_CHUNK ? len : BULK_CHUNK;
+                uint8_t head[4] = {0x04, id, (uint8_t) (n & 0xFF), (uint8_t) (n >> 8)};
+                uint16_t checksum = fletcher16(data, n, fletcher16(&head[1], 3));
+                uint8_t tail[2] = {(uint8_t) (checksum & 0xFF), (uint8_t) (checksum >> 8)};
+
+                // Only the few header/checksum bytes go through the tx buffer
+                s_drivers[_idx].write(head, sizeof(head));
+                s_drivers[_idx].writeDma(data, n);
+                s_drivers[_idx].write(tail, sizeof(tail));
+
+                data += n;
+                len -= n;
+            }
+        }
 
-                    #ifdef USE_CHECKSUM
-                    if (s_drivers[_idx].read((uint8_t*) &checksum, 2)) {
-                        s_drivers[_idx].setPartialRead(true);
-                        r.setError(true);
-                        return *this;
-                    }
-                    uint16_t expected = fletcher16((uint8_t*) &p.buffer, sizeof(p.buffer));
-                    if (checksum != expected) {
-                        s_drivers[_idx].setPartialRead(true);
-                        r.setError(true);
-                        return *this;
-                    }
-                    #endif
+        ITCM_FUNC Conn&
+        Uart::operator>>(Msg& r) {
+            if (_idx < 0) return *this;
+            UartDriver& d = s_drivers[_idx];
+            FrameParser& parser = d.parser();
+            for (;;) {
+                uint8_t byte;
+                // Only times out within a frame
+                if (d.read(&byte, parser.partial())) {
+                    // Skip to the next 0x02 header
+                    parser.fail(&r);
+                    parser.resync();
+                    r.setError(true);
+                    return *this;
                 }
-
+                FrameParser::Result result = parser.feed(byte, &r);
+                if (result == FrameParser::MORE) continue;
+                if (result == FrameParser::FRAME) d.confirmBaud();
+                return *this;
             }
-            r.unpack(p);
-            return *this;
         }
     }
 }
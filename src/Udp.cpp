@@ -0,0 +1,219 @@
+#include "Udp.hpp"
+
+#include <string.h>
+
+#if defined(BOOTLOADER_NATIVE)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <lwip/udp.h>
+#include <lwip/pbuf.h>
+#endif
+
+namespace bootloader {
+    namespace udp {
+        void
+        Udp::parse(const uint8_t* data, size_t len) const {
+            if (len < 1 || data[0] != FRAMES || (len - 1) % 8 || len - 1 > 8 * MAX_FRAMES) {
+                _rxBuf.push(Msg(true));
+                return;
+            }
+            for (size_t i = 1; i < len; i += 8) {
+                Msg* m = _rxBuf.reserve();
+                if (!m) return; // The client will resend
+                memcpy(m->packet().buffer, data + i, 8);
+                m->setError(false);
+                _rxBuf.commit();
+            }
+        }
+
+        bool
+        Udp::hasData() const {
+            // Everything from the last datagram was handled, send
+            // back the replies (and forwards) before taking the next
+            if (_rxBuf.empty() && _txLen > 0) {
+                send(_tx, _txLen);
+                _txLen = 0;
+            }
+            receive();
+            return !_rxBuf.empty();
+        }
+
+        size_t
+        Udp::getReadWindow() const {
+            return _rxBuf.free();
+        }
+
+        size_t
+        Udp::getWriteWindow() const {
+            return _txLen ? (MAX_FRAMES * 8 + 1 - _txLen) / 8 : MAX_FRAMES;
+        }
+
+        void
+        Udp::flush() {
+            if (_txLen > 0) send(_tx, _txLen);
+            _txLen = 0;
+        }
+
+        Conn&
+        Udp::operator>>(Msg &r) {
+            while (!hasData()) {}
+            r = _rxBuf.pop();
+            return *this;
+        }
+
+        Conn&
+        Udp::operator<<(const Msg &w) {
+            if (_txLen == 0) _tx[_txLen++] = FRAMES;
+            memcpy(_tx + _txLen, w.pack().buffer, 8);
+            _txLen += 8;
+            if (_txLen == 1 + 8 * MAX_FRAMES) flush();
+            return *this;
+        }
+
+        const Msg*
+        Udp::peek() {
+            return hasData() ? &_rxBuf.front() : nullptr;
+        }
+
+        void
+        Udp::release() {
+            _rxBuf.drop();
+        }
+
+        void
+        Udp::writeBulk(board_id id, const uint8_t* data, size_t len) {
+            flush(); // The reply goes first
+            for (size_t i = 0; i < len; i += MAX_BULK) {
+                size_t n = len - i < MAX_BULK ? len - i : MAX_BULK;
+                _tx[0] = BULK;
+                _tx[1] = id;
+                _tx[2] = n & 0xFF;
+                _tx[3] = n >> 8;
+                memcpy(_tx + 4, data + i, n);
+                send(_tx, 4 + n);
+            }
+        }
+
+        #if defined(BOOTLOADER_NATIVE)
+        Udp::Udp(uint16_t port) : _sock(-1), _hasPeer(false), _txLen(0) {
+            int sock = socket(AF_INET, SOCK_DGRAM, 0);
+            if (sock < 0) return;
+
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr.sin_port = htons(port);
+            if (bind(sock, (sockaddr*) &addr, sizeof(addr)) ||
+                    fcntl(sock, F_SETFL, O_NONBLOCK)) {
+                ::close(sock);
+                return;
+            }
+            _sock = sock;
+        }
+
+        Udp::~Udp() {
+            close();
+        }
+
+        bool
+        Udp::isOpen() const {
+            return _sock >= 0;
+        }
+
+        void
+        Udp::close() {
+            if (_sock >= 0) ::close(_sock);
+            _sock = -1;
+        }
+
+        void
+        Udp::receive() const {
+            if (_sock < 0) return;
+            uint8_t buf[MAX_DATAGRAM];
+            // Only take another datagram once the last one
+            // is handled, the socket buffer holds the rest
+            while (_rxBuf.empty()) {
+                sockaddr_in from;
+                socklen_t fromLen = sizeof(from);
+                ssize_t n = recvfrom(_sock, buf, sizeof(buf), 0,
+                                        (sockaddr*) &from, &fromLen);
+                if (n < 0) return;
+                static_assert(sizeof(sockaddr_in) <= sizeof(_peer), "peer too small");
+                memcpy(_peer, &from, sizeof(from));
+                _hasPeer = true;
+                parse(buf, n);
+            }
+        }
+
+        void
+        Udp::send(const uint8_t* data, size_t len) const {
+            if (_sock < 0 || !_hasPeer) return;
+            sendto(_sock, data, len, 0, (const sockaddr*) _peer, sizeof(sockaddr_in));
+        }
+        #else
+        Udp::Udp(uint16_t port) : _pcb(nullptr), _hasPeer(false), _txLen(0) {
+            udp_pcb* pcb = udp_new();
+            if (!pcb) return;
+            if (udp_bind(pcb, IP_ADDR_ANY, port) != ERR_OK) {
+                udp_remove(pcb);
+                return;
+            }
+            udp_recv(pcb, (udp_recv_fn) &Udp::recv, this);
+            _pcb = pcb;
+        }
+
+        Udp::~Udp() {
+            close();
+        }
+
+        bool
+        Udp::isOpen() const {
+            return _pcb != nullptr;
+        }
+
+        void
+        Udp::close() {
+            if (_pcb) udp_remove(_pcb);
+            _pcb = nullptr;
+        }
+
+        void
+        Udp::recv(void* arg, udp_pcb* pcb, pbuf* p, const ip4_addr* addr, uint16_t port) {
+            Udp* conn = (Udp*) arg;
+            uint8_t buf[MAX_DATAGRAM];
+            size_t n = pbuf_copy_partial(p, buf, sizeof(buf), 0);
+            pbuf_free(p);
+
+            static_assert(sizeof(ip_addr_t) + 2 <= sizeof(_peer), "peer too small");
+            memcpy(conn->_peer, addr, sizeof(ip_addr_t));
+            memcpy(conn->_peer + sizeof(ip_addr_t), &port, 2);
+            conn->_hasPeer = true;
+            conn->parse(buf, n);
+        }
+
+        void
+        Udp::receive() const {
+            // recv() gets called from the netif input
+        }
+
+        void
+        Udp::send(const uint8_t* data, size_t len) const {
+            if (!_pcb || !_hasPeer) return;
+            pbuf* p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+            if (!p) return; // Out of buffers, the client resends
+            pbuf_take(p, data, len);
+
+            ip_addr_t addr;
+            uint16_t port;
+            memcpy(&addr, _peer, sizeof(ip_addr_t));
+            memcpy(&port, _peer + sizeof(ip_addr_t), 2);
+            udp_sendto(_pcb, p, &addr, port);
+            pbuf_free(p);
+        }
+        #endif
+    }
+}
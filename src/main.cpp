@@ -1,5 +1,7 @@
 #include "Bootloader.hpp"
+#include "StaticContext.hpp"
 #include "System.hpp"
+#include "Image.hpp"
 #include "Uart.hpp"
 #include "Can.hpp"
 #include "Pin.hpp"
@@ -22,27 +24,79 @@ using namespace bootloader::can;
 #define APP_START 0x08080000
 #endif
 
+// Updates get written here first and
+// installed into APP_START on boot
+#ifndef STAGING_START
+#define STAGING_START 0x08140000
+#endif
+
+#ifndef SLOT_SIZE
+#define SLOT_SIZE (STAGING_START - APP_START)
+#endif
+
+// Configs can swap in a StaticContext over
+// the transports from CONF instead
+#ifndef CONTEXT
+#define CONTEXT\
+    Context ctx((uint8_t*) APP_START, (uint8_t*) STAGING_START, SLOT_SIZE,\
+                BOARD_ID, conns, sizeof(conns)/sizeof(Conn*));
+#endif
+
 void start_bootloader() {
 
     // The config
     CONF;
 
-    // Board ID 1, 1 connection
-    Context ctx((uint8_t*) APP_START, BOARD_ID, conns, sizeof(conns)/sizeof(Conn*));
+    CONTEXT;
     ctx.run();
 }
 
 int main(void) {
+    #ifdef BOOT_TIMING
+    bootloader::system::start_cycle_counter();
+    #endif
+
+    uint8_t* app = (uint8_t*) APP_START;
+    uint8_t* staged = (uint8_t*) STAGING_START;
+
+    // Fast path, the mode flag is read straight out of the
+    // backup register, the image was already checked on a
+    // previous boot and there is nothing new staged, so we can
+    // jump without any HAL or clock bring-up (the app does its own anyways)
+    if (getMode() == Mode::APP && image::verified(app, SLOT_SIZE) &&
+            !image::newer(staged, app, SLOT_SIZE)) {
+        setMode(Mode::BOOTLOADER);
+        #ifdef BOOT_TIMING
+        // Cycles (at the 16MHz HSI) from main() to the jump,
+        // left in backup register 1 for the app/debugger to read
+        bootloader::system::write_backup(1, bootloader::system::cycle_count());
+        #endif
+        bootloader::system::jump(image::entry(app));
+    }
+
     bootloader::system::partial_init();
 
-    // Powers up main clocks an everything we need
-    Mode mode = getMode();
-    if (mode == Mode::BOOTLOADER) {
-        bootloader::system::full_init();
-        start_bootloader();
-    } else {
+    if (getMode() == Mode::APP) {
         setMode(Mode::BOOTLOADER);
-        bootloader::system::run((uint32_t*) APP_START);
+        // Install a newer staged image (or fall back to it if the app is bad),
+        // if this gets interrupted the staged copy is still there next boot
+        if (image::newer(staged, app, SLOT_SIZE) || !image::verify(app, SLOT_SIZE)) {
+            if (image::verify(staged, SLOT_SIZE)) {
+                image::install(app, staged, SLOT_SIZE);
+            } else {
+                image::discard(staged);
+            }
+        }
+        // Nothing runs without its digest checking out. That's normally
+        // been done (and remembered in the header) as it was written or
+        // installed, a first boot only hashes it if that got skipped
+        if (image::verify(app, SLOT_SIZE)) {
+            bootloader::system::run(image::entry(app));
+        }
+        // No valid image, stay in the bootloader
     }
-}
 
+    // Powers up main clocks an everything we need
+    bootloader::system::full_init();
+    start_bootloader();
+}